@@ -0,0 +1,119 @@
+#ifndef __SOS_ARENA__
+#define __SOS_ARENA__
+
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+
+/*
+ * Bump allocator for everything decoded from one batch of pages: cell offsets, assembled payloads and
+ * overflow page lists. Nothing is freed on its own, reset() drops it all at once. After a reset the
+ * arena keeps a single block as large as everything the last batch needed, so once the arena has seen
+ * a typical batch, decoding allocates nothing from the heap.
+ */
+struct arena_t {
+    static size_t min_block_size() {
+        return 64 * 1024;
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *current = nullptr;
+    size_t used = 0;
+    size_t capacity = 0;
+    size_t allocated = 0;  // bytes handed out since the last reset
+
+    arena_t() = default;
+
+    arena_t(const arena_t &) = delete;
+
+    arena_t &operator=(const arena_t &) = delete;
+
+    void *allocate(size_t n, size_t alignment) {
+        size_t offset = (used + alignment - 1) & ~(alignment - 1);
+
+        if (!current || offset + n > capacity) {
+            add_block(std::max(n + alignment, std::max(capacity * 2, min_block_size())));
+            offset = (used + alignment - 1) & ~(alignment - 1);
+        }
+
+        used = offset + n;
+        allocated += n;
+        return current + offset;
+    }
+
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t wanted = allocated + allocated / 4;
+            blocks.clear();
+            current = nullptr;
+            capacity = 0;
+            add_block(std::max(wanted, min_block_size()));
+        }
+
+        used = 0;
+        allocated = 0;
+    }
+
+private:
+    void add_block(size_t size) {
+        blocks.emplace_back(new char[size]);
+        current = blocks.back().get();
+        capacity = size;
+        used = 0;
+    }
+};
+
+
+// Standard allocator over an arena_t. Without an arena it falls back to the heap, so containers that
+// are default constructed before they are given an arena keep working.
+template<typename T>
+struct arena_allocator_t {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    arena_t *arena = nullptr;
+
+    arena_allocator_t() = default;
+
+    explicit arena_allocator_t(arena_t *arena) : arena(arena) {}
+
+    template<typename U>
+    arena_allocator_t(const arena_allocator_t<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        if (!arena) {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, size_t) {
+        if (!arena) {
+            ::operator delete(p);
+        }
+    }
+
+    template<typename U>
+    bool operator==(const arena_allocator_t<U> &other) const {
+        return arena == other.arena;
+    }
+
+    template<typename U>
+    bool operator!=(const arena_allocator_t<U> &other) const {
+        return arena != other.arena;
+    }
+};
+
+template<typename T>
+using arena_vector_t = std::vector<T, arena_allocator_t<T>>;
+
+
+#endif /* __SOS_ARENA__ */
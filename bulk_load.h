@@ -0,0 +1,422 @@
+#ifndef __SOS_BULK_LOAD__
+#define __SOS_BULK_LOAD__
+
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "codec.h"
+#include "external_sort.h"
+
+
+/*
+ * Writes an index b-tree bottom-up from keys in sorted order, straight into the pages of a database file
+ * past its last page. Every level fills one page at a time up to the fill factor; when a key no longer
+ * fits, it is held back, and once the next key arrives it becomes the separator pushed up to the level
+ * above. The last page of every level is completed by finish(), and the top page is written over the
+ * given root page. Overflow chains are written when their key is added, pointer map entries are kept in
+ * memory and written by finish() together with the new header on page 1.
+ *
+ * Pages are checksummed with the codec when the file reserves space for a checksum, so FDB opens the
+ * result like any template the insert path filled.
+ */
+struct btree_builder_t {
+    static const uint8_t ptrmap_overflow1 = 3;
+    static const uint8_t ptrmap_overflow2 = 4;
+    static const uint8_t ptrmap_btree = 5;
+
+    struct level_t {
+        std::vector<char> page;
+        uint32_t cells = 0;
+        uint32_t content = 0;            // start of the cell content area
+        std::vector<uint32_t> children;  // left child of every cell, interior levels only
+        std::vector<uint32_t> overflows; // first overflow page of every cell, 0 if the key is all local
+
+        // the key that did not fit, separator between the full page and the next one
+        bool has_pending = false;
+        std::vector<char> pending;
+        uint32_t pending_child = 0;
+        uint32_t pending_overflow = 0;
+    };
+
+    int fd;
+    uint32_t page_size;
+    uint32_t usable_size;
+    page_checksum_codec_t *codec;  // nullptr if pages carry no checksum
+    bool auto_vacuum;
+    uint32_t fill_limit;
+    uint32_t max_local;
+    uint32_t min_local;
+    uint32_t root;
+    uint32_t next_page;
+    uint32_t pending_byte_page;
+
+    std::deque<level_t> levels;
+    std::map<uint32_t, std::vector<char>> ptrmaps;
+    std::vector<char> body;
+    std::vector<char> overflow;
+
+    uint64_t keys = 0;
+    uint64_t leaf_pages = 0;
+    uint64_t interior_pages = 0;
+    uint64_t overflow_pages = 0;
+
+    // page_count is the number of pages the file has now, the tree takes the pages after them.
+    btree_builder_t(int fd, uint32_t page_size, uint32_t reserved_size, page_checksum_codec_t *codec,
+                    bool auto_vacuum, int fill_factor, uint32_t root, uint32_t page_count)
+            : fd(fd), page_size(page_size), usable_size(page_size - reserved_size), codec(codec),
+              auto_vacuum(auto_vacuum), root(root), next_page(page_count + 1),
+              pending_byte_page(0x40000000 / page_size + 1) {
+        fill_limit = (uint32_t) ((uint64_t) usable_size * fill_factor / 100);
+        max_local = (usable_size - 12) * 64 / 255 - 23;
+        min_local = (usable_size - 12) * 32 / 255 - 23;
+
+        // the pointer map pages the file already has keep their entries
+        for (uint32_t pno = 2; auto_vacuum && pno <= page_count; ++pno) {
+            if (is_ptrmap_page(pno)) {
+                read_page(pno, ptrmaps[pno]);
+            }
+        }
+
+        levels.emplace_back();
+        reset(0);
+    }
+
+    void add(const char *key, uint32_t size) {
+        uint32_t head = encode_key(key, size);
+        push(0, 0, body.data(), body.size(), head);
+        keys += 1;
+    }
+
+    // Completes every level and writes pointer maps and page 1. Returns the page count of the file.
+    uint32_t finish() {
+        uint32_t right_child = 0;
+
+        for (size_t i = 0; i < levels.size(); ++i) {
+            level_t &level = levels[i];
+
+            if (level.has_pending) {
+                // the full page gives up its last key as separator, the page after it holds the pending key
+                std::vector<char> pending;
+                pending.swap(level.pending);
+                uint32_t pending_child = level.pending_child;
+                uint32_t pending_overflow = level.pending_overflow;
+                level.has_pending = false;
+
+                std::vector<char> last;
+                uint32_t last_child;
+                uint32_t last_overflow;
+                remove_last_cell(i, last, last_child, last_overflow);
+
+                uint32_t pno = complete(i, last_child, allocate());
+                push(i + 1, pno, last.data(), last.size(), last_overflow);
+
+                reset(i);
+                add_cell(i, pending_child, pending.data(), pending.size(), pending_overflow);
+            }
+
+            if (i + 1 == levels.size()) {
+                complete(i, right_child, root);
+                break;
+            }
+
+            right_child = complete(i, right_child, allocate());
+        }
+
+        uint32_t page_count = next_page - 1;
+
+        for (auto &ptrmap: ptrmaps) {
+            write_page(ptrmap.first, ptrmap.second.data());
+        }
+
+        write_header(page_count);
+
+        if (ftruncate(fd, (off_t) page_count * page_size) != 0 || fsync(fd) != 0) {
+            throw std::runtime_error("cannot complete the bulk loaded file");
+        }
+
+        return page_count;
+    }
+
+    size_t depth() const {
+        return levels.size();
+    }
+
+private:
+    static uint32_t header_size(size_t level) {
+        return level == 0 ? 8 : 12;
+    }
+
+    uint32_t ptrmap_page(uint32_t pno) const {
+        uint32_t pages_per_map = usable_size / 5 + 1;
+        uint32_t map = (pno - 2) / pages_per_map * pages_per_map + 2;
+        return map == pending_byte_page ? map + 1 : map;
+    }
+
+    bool is_ptrmap_page(uint32_t pno) const {
+        return pno >= 2 && ptrmap_page(pno) == pno;
+    }
+
+    uint32_t allocate() {
+        while (next_page == pending_byte_page || (auto_vacuum && is_ptrmap_page(next_page))) {
+            if (next_page != pending_byte_page) {
+                ptrmaps[next_page].assign(page_size, 0);
+            }
+            next_page += 1;
+        }
+
+        return next_page++;
+    }
+
+    void set_ptrmap(uint32_t pno, uint8_t type, uint32_t parent) {
+        if (!auto_vacuum) {
+            return;
+        }
+
+        std::vector<char> &map = ptrmaps[ptrmap_page(pno)];
+        if (map.empty()) {
+            map.assign(page_size, 0);
+        }
+
+        char *entry = map.data() + 5 * (pno - ptrmap_page(pno) - 1);
+        entry[0] = type;
+        *(uint32_t *) (entry + 1) = htonl(parent);
+    }
+
+    void read_page(uint32_t pno, std::vector<char> &page) {
+        page.resize(page_size);
+
+        if (pread(fd, page.data(), page_size, (off_t) (pno - 1) * page_size) != (ssize_t) page_size) {
+            throw std::runtime_error("cannot read page " + std::to_string(pno));
+        }
+    }
+
+    void write_page(uint32_t pno, char *data) {
+        if (codec) {
+            codec->checksum(pno, data, page_size, true);
+        }
+
+        if (pwrite(fd, data, page_size, (off_t) (pno - 1) * page_size) != (ssize_t) page_size) {
+            throw std::runtime_error("cannot write page " + std::to_string(pno));
+        }
+    }
+
+    // Page count and change counter; the version-valid-for number must match the counter or sqlite
+    // ignores the page count.
+    void write_header(uint32_t page_count) {
+        std::vector<char> page;
+        read_page(1, page);
+        char *p = page.data();
+
+        uint32_t change_counter = ntohl(*(uint32_t *) (p + 24)) + 1;
+        *(uint32_t *) (p + 24) = htonl(change_counter);
+        *(uint32_t *) (p + 28) = htonl(page_count);
+        *(uint32_t *) (p + 92) = htonl(change_counter);
+        *(uint32_t *) (p + 96) = htonl(SQLITE_VERSION_NUMBER);
+
+        // page 1 must also verify at the default page size, sqlite reads it that way before it knows better
+        if (codec && page_size > SQLITE_DEFAULT_PAGE_SIZE) {
+            codec->checksum(1, p, SQLITE_DEFAULT_PAGE_SIZE, true);
+        }
+
+        write_page(1, p);
+    }
+
+    uint32_t local_size(uint32_t size) const {
+        if (size <= max_local) {
+            return size;
+        }
+
+        uint32_t surplus = min_local + (size - min_local) % (usable_size - 4);
+        return surplus <= max_local ? surplus : min_local;
+    }
+
+    // The cell of a key without its left child into body; returns the first overflow page, 0 if none.
+    uint32_t encode_key(const char *key, uint32_t size) {
+        uint32_t local = local_size(size);
+
+        body.resize(9 + local + 4);
+        uint8_t *p = (uint8_t *) body.data();
+        int n = write_varint(p, size);
+        memcpy(p + n, key, local);
+
+        if (local == size) {
+            body.resize(n + local);
+            return 0;
+        }
+
+        uint32_t head = write_overflow(key + local, size - local);
+        *(uint32_t *) (p + n + local) = htonl(head);
+        body.resize(n + local + 4);
+        return head;
+    }
+
+    uint32_t write_overflow(const char *data, uint32_t size) {
+        overflow.resize(page_size);
+
+        uint32_t head = allocate();
+        uint32_t pno = head;
+        uint32_t previous = 0;
+
+        while (true) {
+            uint32_t take = std::min(size, usable_size - 4);
+            uint32_t next = size > take ? allocate() : 0;
+
+            memset(overflow.data(), 0, page_size);
+            *(uint32_t *) overflow.data() = htonl(next);
+            memcpy(overflow.data() + 4, data, take);
+            write_page(pno, overflow.data());
+            overflow_pages += 1;
+
+            // the first page points to the b-tree page that will hold the cell, see complete()
+            if (previous != 0) {
+                set_ptrmap(pno, ptrmap_overflow2, previous);
+            }
+
+            if (next == 0) {
+                return head;
+            }
+
+            data += take;
+            size -= take;
+            previous = pno;
+            pno = next;
+        }
+    }
+
+    uint32_t cell_size(size_t level, size_t body_size) const {
+        return std::max<uint32_t>(4, (uint32_t) body_size + (level == 0 ? 0 : 4));
+    }
+
+    bool fits(size_t i, uint32_t size) const {
+        const level_t &level = levels[i];
+        uint32_t used = header_size(i) + 2 * (level.cells + 1) + (usable_size - level.content) + size;
+
+        // at least two cells per page, so a full page can always give one up in finish()
+        return used <= usable_size && (used <= fill_limit || level.cells < 2);
+    }
+
+    void reset(size_t i) {
+        level_t &level = levels[i];
+
+        level.page.assign(page_size, 0);
+        level.cells = 0;
+        level.content = usable_size;
+        level.children.clear();
+        level.overflows.clear();
+    }
+
+    void add_cell(size_t i, uint32_t child, const char *cell, size_t size, uint32_t head) {
+        level_t &level = levels[i];
+        char *p = level.page.data();
+
+        level.content -= cell_size(i, size);
+
+        if (i == 0) {
+            memcpy(p + level.content, cell, size);
+        } else {
+            *(uint32_t *) (p + level.content) = htonl(child);
+            memcpy(p + level.content + 4, cell, size);
+        }
+
+        *(uint16_t *) (p + header_size(i) + 2 * level.cells) = htons((uint16_t) level.content);
+        level.cells += 1;
+        level.children.push_back(child);
+        level.overflows.push_back(head);
+    }
+
+    void remove_last_cell(size_t i, std::vector<char> &cell, uint32_t &child, uint32_t &head) {
+        level_t &level = levels[i];
+        char *p = level.page.data();
+        const char *position = p + level.content + (i == 0 ? 0 : 4);
+
+        uint64_t size;
+        int n = read_varint((const uint8_t *) position, (const uint8_t *) position + 9, size);
+        uint32_t local = local_size((uint32_t) size);
+        cell.assign(position, position + n + local + (local < size ? 4 : 0));
+
+        child = level.children.back();
+        head = level.overflows.back();
+
+        uint32_t stored = cell_size(i, cell.size());
+        memset(p + level.content, 0, stored);
+        level.content += stored;
+        level.cells -= 1;
+        memset(p + header_size(i) + 2 * level.cells, 0, 2);
+        level.children.pop_back();
+        level.overflows.pop_back();
+    }
+
+    void push(size_t i, uint32_t child, const char *cell, size_t size, uint32_t head) {
+        if (i == levels.size()) {
+            levels.emplace_back();
+            reset(i);
+        }
+
+        level_t &level = levels[i];
+
+        if (level.has_pending) {
+            // the page before the pending key is done, the pending key separates it from the page this one starts
+            uint32_t pno = complete(i, level.pending_child, allocate());
+            push(i + 1, pno, level.pending.data(), level.pending.size(), level.pending_overflow);
+
+            level.has_pending = false;
+            reset(i);
+            add_cell(i, child, cell, size, head);
+            return;
+        }
+
+        if (fits(i, cell_size(i, size))) {
+            add_cell(i, child, cell, size, head);
+            return;
+        }
+
+        level.has_pending = true;
+        level.pending.assign(cell, cell + size);
+        level.pending_child = child;
+        level.pending_overflow = head;
+    }
+
+    // Writes the page of a level as page pno and points its children and overflow chains at it.
+    uint32_t complete(size_t i, uint32_t right_child, uint32_t pno) {
+        level_t &level = levels[i];
+        char *p = level.page.data();
+
+        p[0] = i == 0 ? 0x0a : 0x02;
+        *(uint16_t *) (p + 3) = htons((uint16_t) level.cells);
+        *(uint16_t *) (p + 5) = htons((uint16_t) level.content);
+
+        if (i == 0) {
+            leaf_pages += 1;
+        } else {
+            *(uint32_t *) (p + 8) = htonl(right_child);
+            set_ptrmap(right_child, ptrmap_btree, pno);
+            interior_pages += 1;
+
+            for (uint32_t child: level.children) {
+                set_ptrmap(child, ptrmap_btree, pno);
+            }
+        }
+
+        for (uint32_t head: level.overflows) {
+            if (head != 0) {
+                set_ptrmap(head, ptrmap_overflow1, pno);
+            }
+        }
+
+        write_page(pno, p);
+        return pno;
+    }
+};
+
+
+#endif /* __SOS_BULK_LOAD__ */
@@ -0,0 +1,257 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <iostream>
+#include <iomanip>
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "hash3.h"
+
+extern "C" {
+#include "sqlite/sqliteInt.h"
+}
+
+#include "codec.h"
+
+
+/*
+ * Measures the page checksum: lookup3 itself, and page_checksum_codec_t::checksum() writing and verifying
+ * sums, one page at a time and a batch at a time, for every page size sqlite allows, on pages aligned to
+ * 64 bytes and on pages one byte off, which take the byte-at-a-time path of hashlittle(). Reports GB/s and
+ * time-stamp counter cycles per byte. Before timing anything it checks lookup3 against the known vectors of
+ * the drivers in hash3.c and the batch results against the single page ones, so a faster implementation
+ * that breaks the sums fails here instead of in a restore.
+ */
+
+const int batch_pages = 16;
+
+struct bench_result_t {
+    double seconds = 0;
+    uint64_t bytes = 0;
+    uint64_t cycles = 0;
+
+    double gb_per_second() const {
+        return bytes / seconds / 1e9;
+    }
+
+    double cycles_per_byte() const {
+        return cycles / (double) bytes;
+    }
+};
+
+uint64_t read_cycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Calls fn, which hashes bytes_per_call bytes, until at least millis have passed.
+bench_result_t measure(int millis, uint64_t bytes_per_call, const std::function<void()> &fn) {
+    bench_result_t result;
+    auto limit = std::chrono::milliseconds(millis);
+
+    // warm the caches and the branch predictors
+    fn();
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_cycles = read_cycles();
+    uint64_t calls = 0;
+
+    while (std::chrono::steady_clock::now() - start < limit) {
+        for (int i = 0; i < 16; ++i) {
+            fn();
+        }
+        calls += 16;
+    }
+
+    result.cycles = read_cycles() - start_cycles;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.bytes = calls * bytes_per_call;
+    return result;
+}
+
+// The known vectors of driver5() in hash3.c.
+void check_known_vectors() {
+    const char *text = "Four score and seven years ago";
+    struct {
+        uint32_t c, b, hash_c, hash_b;
+    } vectors[] = {
+            {0,          0,          0x17770551, 0xce7226e6},
+            {0,          1,          0xe3607cae, 0xbd371de4},
+            {1,          0,          0xcd628161, 0x6cbea4b3},
+    };
+
+    for (auto &v: vectors) {
+        uint32_t c = v.c, b = v.b;
+        hashlittle2(text, 30, &c, &b);
+        if (c != v.hash_c || b != v.hash_b) {
+            std::cout << "ERROR: hashlittle2() does not match the known vectors" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    if (hashlittle(text, 30, 0) != 0x17770551 || hashlittle(text, 30, 1) != 0xcd628161) {
+        std::cout << "ERROR: hashlittle() does not match the known vectors" << std::endl;
+        std::exit(1);
+    }
+}
+
+struct page_set_t {
+    std::vector<char> memory;
+    void *pages[batch_pages];
+    Pgno numbers[batch_pages];
+
+    page_set_t(int page_size, int offset) : memory((size_t) batch_pages * page_size + 64 + offset) {
+        std::mt19937 random(page_size + offset);
+        for (char &byte: memory) {
+            byte = (char) random();
+        }
+
+        char *base = memory.data() + (64 - (uintptr_t) memory.data() % 64) % 64 + offset;
+        for (int i = 0; i < batch_pages; ++i) {
+            pages[i] = base + (size_t) i * page_size;
+            numbers[i] = 2 + i;
+        }
+    }
+};
+
+// The batch checksum must write and accept exactly the sums the single page one does.
+void check_batch(page_checksum_codec_t &codec, page_set_t &set, int page_size) {
+    std::vector<std::string> sums;
+    bool valid[batch_pages];
+
+    for (int i = 0; i < batch_pages; ++i) {
+        codec.checksum(set.numbers[i], set.pages[i], page_size, true);
+        sums.emplace_back((char *) set.pages[i] + page_size - 8, 8);
+    }
+
+    codec.checksum(set.numbers, set.pages, batch_pages, page_size, false, valid);
+    for (int i = 0; i < batch_pages; ++i) {
+        if (!valid[i]) {
+            std::cout << "ERROR: batch checksum rejects page " << set.numbers[i] << " of " << page_size
+                      << " bytes" << std::endl;
+            std::exit(1);
+        }
+        memset((char *) set.pages[i] + page_size - 8, 0, 8);
+    }
+
+    codec.checksum(set.numbers, set.pages, batch_pages, page_size, true, nullptr);
+    for (int i = 0; i < batch_pages; ++i) {
+        if (sums[i] != std::string((char *) set.pages[i] + page_size - 8, 8)) {
+            std::cout << "ERROR: batch checksum writes a different sum to page " << set.numbers[i] << " of "
+                      << page_size << " bytes" << std::endl;
+            std::exit(1);
+        }
+    }
+}
+
+void print_result(int page_size, const char *alignment, const char *function, const bench_result_t &result) {
+    std::cout << std::setw(9) << page_size << "  " << std::setw(9) << alignment << "  " << std::left
+              << std::setw(18) << function << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << result.gb_per_second();
+#ifdef HAVE_RDTSC
+    std::cout << std::setw(13) << result.cycles_per_byte();
+#else
+    std::cout << std::setw(13) << "-";
+#endif
+    std::cout << std::endl;
+}
+
+void bench_page_size(int millis, int page_size, int offset) {
+    page_set_t set(page_size, offset);
+    page_checksum_codec_t codec("checksum_bench");
+    const char *alignment = offset == 0 ? "aligned" : "unaligned";
+    uint64_t data_bytes = (uint64_t) batch_pages * (page_size - 8);
+    volatile uint32_t sink = 0;
+    bool valid[batch_pages];
+
+    check_batch(codec, set, page_size);
+
+    print_result(page_size, alignment, "hashlittle", measure(millis, data_bytes, [&] {
+        for (int i = 0; i < batch_pages; ++i) {
+            sink = sink + hashlittle(set.pages[i], page_size - 8, set.numbers[i]);
+        }
+    }));
+
+    print_result(page_size, alignment, "hashlittle2", measure(millis, data_bytes, [&] {
+        for (int i = 0; i < batch_pages; ++i) {
+            uint32_t c = set.numbers[i], b = 0x5ca1ab1e;
+            hashlittle2(set.pages[i], page_size - 8, &c, &b);
+            sink = sink + c + b;
+        }
+    }));
+
+    print_result(page_size, alignment, "hashlittle2_xN", measure(millis, data_bytes, [&] {
+        uint32_t c[batch_pages], b[batch_pages];
+        for (int i = 0; i < batch_pages; ++i) {
+            c[i] = set.numbers[i];
+            b[i] = 0x5ca1ab1e;
+        }
+        hashlittle2_xN(set.pages, page_size - 8, c, b, batch_pages);
+        sink = sink + c[0] + b[0];
+    }));
+
+    print_result(page_size, alignment, "checksum write", measure(millis, data_bytes, [&] {
+        for (int i = 0; i < batch_pages; ++i) {
+            codec.checksum(set.numbers[i], set.pages[i], page_size, true);
+        }
+    }));
+
+    print_result(page_size, alignment, "checksum read", measure(millis, data_bytes, [&] {
+        for (int i = 0; i < batch_pages; ++i) {
+            if (!codec.checksum(set.numbers[i], set.pages[i], page_size, false)) {
+                std::cout << "ERROR: checksum rejects page " << set.numbers[i] << std::endl;
+                std::exit(1);
+            }
+        }
+    }));
+
+    print_result(page_size, alignment, "batch write", measure(millis, data_bytes, [&] {
+        codec.checksum(set.numbers, set.pages, batch_pages, page_size, true, nullptr);
+    }));
+
+    print_result(page_size, alignment, "batch read", measure(millis, data_bytes, [&] {
+        codec.checksum(set.numbers, set.pages, batch_pages, page_size, false, valid);
+        if (!valid[0]) {
+            std::cout << "ERROR: batch checksum rejects page " << set.numbers[0] << std::endl;
+            std::exit(1);
+        }
+    }));
+}
+
+int main(int argc, const char **argv) {
+    int millis = 200;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--millis=", 9) == 0 && atoi(argv[i] + 9) > 0) {
+            millis = atoi(argv[i] + 9);
+        } else {
+            std::cout << "Usage:" << std::endl
+                      << "  checksum_bench [--millis=N]" << std::endl
+                      << "    " << "--millis=N: time spent on each measurement, default 200" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    check_known_vectors();
+
+    std::cout << "page size  alignment  function              GB/s  cycles/byte" << std::endl;
+
+    for (int page_size = 512; page_size <= 65536; page_size *= 2) {
+        bench_page_size(millis, page_size, 0);
+        bench_page_size(millis, page_size, 1);
+    }
+
+    return 0;
+}
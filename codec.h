@@ -2,12 +2,14 @@
 #define __HASHDATA_CODEC__
 
 
+#include <memory>
 #include <string>
 
 #include "sqlite/sqliteInt.h"
 #include "sqlite/sqlite3.h"
 
 #include "hash3.h"
+#include "worker_pool.h"
 
 
 inline std::string format(const char *form, ...) {
@@ -49,6 +51,9 @@ struct page_checksum_codec_t {
     std::string filename;
     bool silent;
 
+    // Hashes the pages of a batch, see codecBatch().
+    std::unique_ptr<worker_pool_t> pool;
+
     struct sum_type_t {
         bool operator==(const sum_type_t &rhs) const { return part1 == rhs.part1 && part2 == rhs.part2; }
 
@@ -87,6 +92,37 @@ struct page_checksum_codec_t {
         return true;
     }
 
+    // checksum() of n pages at once, hashed side by side by hashlittle2_xN() in groups of 16. valid[i] is
+    // set to the result for pages[i] when verifying, and may be null when writing.
+    void checksum(const Pgno *pageNumbers, void *const *pages, int n, int pageLen, bool write, bool *valid) {
+        const int group = 16;
+        int dataLen = pageLen - sizeof(sum_type_t);
+
+        for (int first = 0; first < n; first += group) {
+            int count = std::min(group, n - first);
+            uint32_t part1[group];
+            uint32_t part2[group];
+
+            for (int i = 0; i < count; ++i) {
+                part1[i] = pageNumbers[first + i]; //DO NOT CHANGE
+                part2[i] = 0x5ca1ab1e;
+            }
+
+            hashlittle2_xN(pages + first, dataLen, part1, part2, count);
+
+            for (int i = 0; i < count; ++i) {
+                sum_type_t *pSumInPage = (sum_type_t *) ((char *) pages[first + i] + dataLen);
+
+                if (write) {
+                    pSumInPage->part1 = part1[i];
+                    pSumInPage->part2 = part2[i];
+                } else {
+                    valid[first + i] = pSumInPage->part1 == part1[i] && pSumInPage->part2 == part2[i];
+                }
+            }
+        }
+    }
+
     static void *codec(void *vpSelf, void *data, Pgno pageNumber, int op) {
         page_checksum_codec_t *self = (page_checksum_codec_t *) vpSelf;
 
@@ -121,6 +157,46 @@ struct page_checksum_codec_t {
         return data;
     }
 
+    // Encodes the pages of a write-out in place, like codec() with op 6 for each of them, in slices of pages
+    // spread over the pool, each slice hashed by the batch checksum(). Returns 0 if a page cannot be encoded,
+    // and the pager then encodes page by page.
+    static int codecBatch(void *vpSelf, void **pages, Pgno *numbers, int n) {
+        page_checksum_codec_t *self = (page_checksum_codec_t *) vpSelf;
+        const int slice = 16;
+        std::atomic<bool> failed{false};
+
+        std::function<void(size_t)> encode = [&](size_t s) {
+            void *batch[slice];
+            Pgno batchNumbers[slice];
+            int count = 0;
+
+            for (int i = s * slice; i < std::min<int>(n, (s + 1) * slice); ++i) {
+                // page 1 carries a second checksum and a wrong reserve size fails, both as codec() does them
+                if (numbers[i] == 1 || self->reserveSize != sizeof(sum_type_t)) {
+                    if (!codec(self, pages[i], numbers[i], 6)) {
+                        failed = true;
+                    }
+                } else {
+                    batch[count] = pages[i];
+                    batchNumbers[count] = numbers[i];
+                    count += 1;
+                }
+            }
+
+            self->checksum(batchNumbers, batch, count, self->pageSize, true, nullptr);
+        };
+
+        if (!self->pool || n <= slice) {
+            for (int s = 0; s * slice < n; ++s) {
+                encode(s);
+            }
+        } else {
+            self->pool->run((n + slice - 1) / slice, encode);
+        }
+
+        return failed ? 0 : 1;
+    }
+
     static void sizeChange(void *vpSelf, int new_pageSize, int new_reserveSize) {
         page_checksum_codec_t *self = (page_checksum_codec_t *) vpSelf;
         self->pageSize = new_pageSize;
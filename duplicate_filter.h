@@ -0,0 +1,53 @@
+#ifndef __SOS_DUPLICATE_FILTER__
+#define __SOS_DUPLICATE_FILTER__
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "hash3.h"
+
+
+/*
+ * Bloom filter of the keys inserted so far, split into 64 byte blocks: a key sets one bit in each of the
+ * eight words of one block, so a lookup touches a single cache line. A key whose bits are not all set was
+ * never added; a key whose bits are all set probably was. The filter never grows, as more keys are added
+ * than it was sized for only the share of false positives rises.
+ */
+struct duplicate_filter_t {
+    std::vector<uint64_t> words;
+    uint64_t blocks = 0;
+
+    explicit duplicate_filter_t(size_t memory) {
+        blocks = std::max<uint64_t>(1, memory / 64);
+        words.assign(blocks * 8, 0);
+    }
+
+    // 64 bits of lookup3, the hash the page checksums use.
+    static uint64_t hash(const char *key, size_t size) {
+        uint32_t primary = 0;
+        uint32_t secondary = 0;
+        hashlittle2(key, size, &primary, &secondary);
+        return ((uint64_t) primary << 32) | secondary;
+    }
+
+    // Adds the key; true if all its bits were set already, so the key may have been added before.
+    bool test_and_add(uint64_t hash) {
+        uint64_t *block = &words[((hash >> 32) * blocks >> 32) * 8];
+        uint64_t bits = hash * 0x9e3779b97f4a7c15ULL;
+        bool present = true;
+
+        for (int i = 0; i < 8; ++i) {
+            uint64_t mask = 1ULL << ((bits >> (6 * i + 16)) & 63);
+            present = present && (block[i] & mask) != 0;
+            block[i] |= mask;
+        }
+
+        return present;
+    }
+};
+
+
+#endif /* __SOS_DUPLICATE_FILTER__ */
@@ -0,0 +1,668 @@
+#ifndef __SOS_EXTERNAL_SORT__
+#define __SOS_EXTERNAL_SORT__
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+
+// sqlite varint: 7 bits per byte, most significant first, the 9th byte carries 8 bits.
+inline int read_varint(const uint8_t *p, const uint8_t *end, uint64_t &value) {
+    value = 0;
+
+    for (int i = 0; i < 9; ++i) {
+        if (p + i >= end) {
+            return 0;
+        }
+
+        if (i == 8) {
+            value = (value << 8) | p[i];
+            return 9;
+        }
+
+        value = (value << 7) | (p[i] & 0x7f);
+
+        if (!(p[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+inline int write_varint(uint8_t *p, uint64_t value) {
+    if (value & 0xff00000000000000ULL) {
+        p[8] = (uint8_t) value;
+        value >>= 8;
+
+        for (int i = 7; i >= 0; --i) {
+            p[i] = (uint8_t) ((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+
+        return 9;
+    }
+
+    uint8_t reversed[9];
+    int n = 0;
+
+    do {
+        reversed[n++] = (uint8_t) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    } while (value != 0);
+
+    reversed[0] &= 0x7f;
+
+    for (int i = 0; i < n; ++i) {
+        p[i] = reversed[n - 1 - i];
+    }
+
+    return n;
+}
+
+
+// One column of a record: serial type and the bytes of its value.
+struct record_field_t {
+    uint64_t type;
+    const uint8_t *data;
+    uint32_t size;
+
+    static uint32_t value_size(uint64_t type) {
+        static const uint8_t sizes[12] = {0, 1, 2, 3, 4, 6, 8, 8, 0, 0, 0, 0};
+        return type >= 12 ? (uint32_t) ((type - 12) / 2) : sizes[type];
+    }
+
+    // NULL < numbers < text < blob, as sqlite orders values of different types.
+    int type_class() const {
+        return type == 0 ? 0 : type < 12 ? 1 : (type & 1) ? 2 : 3;
+    }
+
+    bool is_integer() const {
+        return type != 0 && type < 12 && type != 7;
+    }
+
+    int64_t integer() const {
+        if (type == 8 || type == 9) {
+            return type - 8;
+        }
+
+        int64_t value = (int8_t) data[0];
+        for (uint32_t i = 1; i < size; ++i) {
+            value = (value << 8) | data[i];
+        }
+
+        return value;
+    }
+
+    double real() const {
+        if (type != 7) {
+            return (double) integer();
+        }
+
+        uint64_t bits = 0;
+        for (uint32_t i = 0; i < 8; ++i) {
+            bits = (bits << 8) | data[i];
+        }
+
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+};
+
+/*
+ * Splits a record into its fields and keeps the first max_fields of them. False if the header or a value
+ * runs past the end of the record, or a value could not have been written by sqlite (reserved serial types,
+ * NaN), so a malformed key never reaches a comparison.
+ */
+inline bool decode_record(const char *record, uint32_t size, record_field_t *fields, int max_fields, int &count) {
+    const uint8_t *p = (const uint8_t *) record;
+    const uint8_t *end = p + size;
+
+    uint64_t header_size;
+    int n = read_varint(p, end, header_size);
+
+    if (n == 0 || header_size < (uint64_t) n || header_size > size) {
+        return false;
+    }
+
+    const uint8_t *header = p + n;
+    const uint8_t *header_end = p + header_size;
+    uint64_t offset = header_size;
+
+    count = 0;
+
+    while (header < header_end) {
+        uint64_t type;
+        n = read_varint(header, header_end, type);
+
+        if (n == 0 || type == 10 || type == 11) {
+            return false;
+        }
+
+        header += n;
+
+        uint32_t value_size = record_field_t::value_size(type);
+        if (offset + value_size > size) {
+            return false;
+        }
+
+        record_field_t field{type, p + offset, value_size};
+
+        if (type == 7 && std::isnan(field.real())) {
+            return false;
+        }
+
+        if (count < max_fields) {
+            fields[count] = field;
+        }
+
+        count += 1;
+        offset += value_size;
+    }
+
+    return true;
+}
+
+// sqlite3MemCompare() with the BINARY collation.
+inline int compare_fields(const record_field_t &a, const record_field_t &b) {
+    int ca = a.type_class();
+    int cb = b.type_class();
+
+    if (ca != cb) {
+        return ca < cb ? -1 : 1;
+    }
+
+    if (ca == 0) {
+        return 0;
+    }
+
+    if (ca == 1) {
+        if (a.is_integer() && b.is_integer()) {
+            int64_t ia = a.integer();
+            int64_t ib = b.integer();
+            return ia < ib ? -1 : ia > ib ? 1 : 0;
+        }
+
+        double ra = a.real();
+        double rb = b.real();
+        return ra < rb ? -1 : ra > rb ? 1 : 0;
+    }
+
+    int r = memcmp(a.data, b.data, std::min(a.size, b.size));
+    if (r != 0) {
+        return r;
+    }
+
+    return a.size < b.size ? -1 : a.size > b.size ? 1 : 0;
+}
+
+/*
+ * Orders two well-formed keys the way the restore cursor does: on the first two fields, a key with fewer
+ * fields first. Keys with more fields than the cursor compares on are never equal to each other in sqlite,
+ * even byte for byte, so an insert keeps them all; their bytes break the tie here.
+ */
+inline int compare_records(const char *a, uint32_t na, const char *b, uint32_t nb) {
+    record_field_t fa[2];
+    record_field_t fb[2];
+    int ca = 0;
+    int cb = 0;
+
+    decode_record(a, na, fa, 2, ca);
+    decode_record(b, nb, fb, 2, cb);
+
+    for (int i = 0; i < std::min(std::min(ca, cb), 2); ++i) {
+        int r = compare_fields(fa[i], fb[i]);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    if (ca != cb) {
+        return ca < cb ? -1 : 1;
+    }
+
+    if (ca <= 2) {
+        return 0;
+    }
+
+    int r = memcmp(a, b, std::min(na, nb));
+    if (r != 0) {
+        return r;
+    }
+
+    return na < nb ? -1 : na > nb ? 1 : 0;
+}
+
+
+// An insert replaces a key equal to it, which only happens for keys of at most two fields.
+inline bool replaces_key(const char *a, uint32_t na, const char *b, uint32_t nb) {
+    record_field_t fields[2];
+    int count = 0;
+
+    decode_record(a, na, fields, 2, count);
+    return count <= 2 && compare_records(a, na, b, nb) == 0;
+}
+
+inline bool identical_key(const char *a, uint32_t na, const char *b, uint32_t nb) {
+    return na == nb && memcmp(a, b, na) == 0;
+}
+
+// Compares only the fields the restore cursor compares on; keys that cannot be decoded are never equal.
+inline int compare_key_fields(const char *a, uint32_t na, const char *b, uint32_t nb) {
+    record_field_t fa[2];
+    record_field_t fb[2];
+    int ca = 0;
+    int cb = 0;
+
+    if (!decode_record(a, na, fa, 2, ca) || !decode_record(b, nb, fb, 2, cb)) {
+        return 1;
+    }
+
+    for (int i = 0; i < std::min(std::min(ca, cb), 2); ++i) {
+        int r = compare_fields(fa[i], fb[i]);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    return std::min(ca, 2) - std::min(cb, 2);
+}
+
+// What becomes of the earlier of two adjacent sorted keys.
+enum class key_fate_t {
+    kept,
+    replaced,   // an insert of the later key replaces it
+    identical,  // byte for byte the same as the later key, dropped only when asked to
+};
+
+inline key_fate_t adjacent_key_fate(const char *a, uint32_t na, const char *b, uint32_t nb, bool drop_identical) {
+    if (replaces_key(a, na, b, nb)) {
+        return key_fate_t::replaced;
+    }
+
+    if (drop_identical && identical_key(a, na, b, nb)) {
+        return key_fate_t::identical;
+    }
+
+    return key_fate_t::kept;
+}
+
+
+/*
+ * Keys held in memory, one run of the sorter. Malformed keys are counted and dropped: sqlite orders them
+ * by whatever their broken header says, and a key with no consistent place in the sort order would
+ * misdirect lookups of valid keys once it is a separator.
+ */
+struct key_store_t {
+    struct key_t {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    std::vector<char> bytes;
+    std::vector<key_t> keys;
+
+    uint64_t malformed = 0;
+    uint64_t duplicates = 0;
+
+    // also drop keys that an insert would keep next to an identical copy, see --skip-duplicates
+    bool drop_identical = false;
+    uint64_t identical = 0;
+
+    // Takes memory bytes up front, so the store never grows past its budget by reallocating.
+    void reserve(size_t memory) {
+        keys.reserve(memory / 8 / sizeof(key_t));
+        bytes.reserve(memory - memory / 8);
+    }
+
+    bool fits(uint32_t size) const {
+        return bytes.size() + size <= bytes.capacity() && keys.size() < keys.capacity();
+    }
+
+    void add(const char *data, uint32_t size) {
+        record_field_t fields[2];
+        int count;
+
+        if (!decode_record(data, size, fields, 2, count)) {
+            malformed += 1;
+            return;
+        }
+
+        keys.push_back({bytes.size(), size});
+        bytes.insert(bytes.end(), data, data + size);
+    }
+
+    const char *data(const key_t &key) const {
+        return bytes.data() + key.offset;
+    }
+
+    // Sorts the keys; of keys that replace each other only the one added last is kept, the same for
+    // identical keys if they are dropped.
+    void sort() {
+        auto compare = [this](const key_t &a, const key_t &b) {
+            return compare_records(data(a), a.size, data(b), b.size) < 0;
+        };
+
+        std::stable_sort(keys.begin(), keys.end(), compare);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (i + 1 < keys.size()) {
+                const key_t &a = keys[i];
+                const key_t &b = keys[i + 1];
+                key_fate_t fate = adjacent_key_fate(data(a), a.size, data(b), b.size, drop_identical);
+
+                if (fate != key_fate_t::kept) {
+                    (fate == key_fate_t::replaced ? duplicates : identical) += 1;
+                    continue;
+                }
+            }
+
+            keys[kept++] = keys[i];
+        }
+
+        keys.resize(kept);
+    }
+
+    void clear() {
+        bytes.clear();
+        keys.clear();
+    }
+};
+
+
+/*
+ * A sorted run spilled to an unlinked scratch file, front coded: every key is stored as the length of
+ * the prefix it shares with the key before it, the length of the rest and the rest. Sorted FDB keys
+ * share most of their bytes with their neighbour, so runs take a fraction of the key bytes.
+ */
+struct sort_run_t {
+    FILE *file = nullptr;
+    uint64_t keys = 0;
+    uint64_t key_bytes = 0;
+    uint64_t file_bytes = 0;
+
+    // the key last written or read
+    std::vector<char> key;
+    uint64_t remaining = 0;
+
+    // buffer is the stdio buffer of the run, the merge reads all runs at once through theirs
+    sort_run_t(const std::string &dir, size_t buffer) {
+        std::string path = dir + "/sos-sort-XXXXXX";
+        int fd = mkstemp(&path[0]);
+
+        if (fd < 0) {
+            throw std::runtime_error("cannot create a sort run in " + dir);
+        }
+
+        unlink(path.data());
+        file = fdopen(fd, "w+");
+        setvbuf(file, nullptr, _IOFBF, buffer);
+    }
+
+    sort_run_t(const sort_run_t &) = delete;
+
+    sort_run_t &operator=(const sort_run_t &) = delete;
+
+    ~sort_run_t() {
+        fclose(file);
+    }
+
+    void write(const char *data, uint32_t size) {
+        uint32_t shared = 0;
+        uint32_t limit = std::min<uint32_t>(size, key.size());
+
+        while (shared < limit && key[shared] == data[shared]) {
+            shared += 1;
+        }
+
+        uint8_t lengths[18];
+        int n = write_varint(lengths, shared);
+        n += write_varint(lengths + n, size - shared);
+
+        if (fwrite(lengths, 1, n, file) != (size_t) n || fwrite(data + shared, 1, size - shared, file) != size - shared) {
+            throw std::runtime_error("cannot write a sort run");
+        }
+
+        key.assign(data, data + size);
+        keys += 1;
+        key_bytes += size;
+        file_bytes += n + size - shared;
+    }
+
+    // Switches from writing to reading and reads the first key.
+    void rewind() {
+        if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0) {
+            throw std::runtime_error("cannot read back a sort run");
+        }
+
+        key.clear();
+        remaining = keys;
+        advance();
+    }
+
+    // Reads the next key, false at the end of the run.
+    bool advance() {
+        if (remaining == 0) {
+            return false;
+        }
+
+        uint64_t shared = read_length();
+        uint64_t rest = read_length();
+
+        key.resize(shared + rest);
+        if (fread(key.data() + shared, 1, rest, file) != rest) {
+            throw std::runtime_error("sort run is truncated");
+        }
+
+        remaining -= 1;
+        return true;
+    }
+
+private:
+    uint64_t read_length() {
+        uint8_t bytes[9];
+
+        for (int i = 0; i < 9; ++i) {
+            int c = getc_unlocked(file);
+
+            if (c == EOF) {
+                throw std::runtime_error("sort run is truncated");
+            }
+
+            bytes[i] = (uint8_t) c;
+
+            if (i == 8 || !(c & 0x80)) {
+                uint64_t value;
+                read_varint(bytes, bytes + i + 1, value);
+                return value;
+            }
+        }
+
+        return 0;
+    }
+};
+
+
+/*
+ * External merge sort of recovered keys. Keys are collected in memory up to the budget; a full store is
+ * sorted and spilled as a run to the scratch directory, and finish() merges all runs k ways into one key
+ * ordered stream read with next(). Input that fits the budget is never written out. Keys that replace
+ * each other on insert (and identical keys, if asked to) are dropped except the one added last, within a
+ * run and across runs, since later runs hold later keys.
+ */
+struct key_sorter_t {
+    std::string dir;
+    size_t memory;
+    key_store_t store;
+    std::vector<std::unique_ptr<sort_run_t>> runs;
+
+    std::vector<size_t> heap;  // runs with keys left, smallest key first
+    size_t position = 0;       // next key of the store when nothing was spilled
+
+    std::vector<char> current; // the key read last, returned once the key after it does not replace it
+    std::vector<char> output;
+    bool has_current = false;
+
+    uint64_t keys = 0;         // keys returned by next()
+    uint64_t duplicates = 0;
+    uint64_t identical = 0;
+
+    key_sorter_t(const std::string &dir, size_t memory, bool drop_identical) : dir(dir), memory(memory) {
+        store.reserve(memory);
+        store.drop_identical = drop_identical;
+    }
+
+    void add(const char *data, uint32_t size) {
+        if (!store.fits(size) && !store.keys.empty()) {
+            spill();
+        }
+
+        store.add(data, size);
+    }
+
+    void finish() {
+        if (runs.empty()) {
+            store.sort();
+            duplicates += store.duplicates;
+            identical += store.identical;
+            return;
+        }
+
+        if (!store.keys.empty()) {
+            spill();
+        }
+
+        // the merge only needs the runs' read buffers
+        store.bytes = std::vector<char>();
+        store.keys = std::vector<key_store_t::key_t>();
+
+        for (size_t i = 0; i < runs.size(); ++i) {
+            runs[i]->rewind();
+            push_run(i);
+        }
+    }
+
+    bool next(const char *&data, uint32_t &size) {
+        if (runs.empty()) {
+            if (position == store.keys.size()) {
+                return false;
+            }
+
+            const key_store_t::key_t &key = store.keys[position++];
+            data = store.data(key);
+            size = key.size;
+            keys += 1;
+            return true;
+        }
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return later(a, b); });
+            size_t run = heap.back();
+            heap.pop_back();
+
+            std::vector<char> &key = runs[run]->key;
+            key_fate_t fate = key_fate_t::kept;
+
+            if (has_current) {
+                fate = adjacent_key_fate(current.data(), current.size(), key.data(), key.size(), store.drop_identical);
+                duplicates += fate == key_fate_t::replaced;
+                identical += fate == key_fate_t::identical;
+            }
+
+            bool ready = has_current && fate == key_fate_t::kept;
+            if (ready) {
+                output.swap(current);
+            }
+
+            current.assign(key.begin(), key.end());
+            has_current = true;
+
+            if (runs[run]->advance()) {
+                push_run(run);
+            }
+
+            if (ready) {
+                data = output.data();
+                size = output.size();
+                keys += 1;
+                return true;
+            }
+        }
+
+        if (has_current) {
+            output.swap(current);
+            has_current = false;
+            data = output.data();
+            size = output.size();
+            keys += 1;
+            return true;
+        }
+
+        return false;
+    }
+
+    uint64_t malformed() const {
+        return store.malformed;
+    }
+
+    uint64_t run_key_bytes() const {
+        uint64_t total = 0;
+        for (auto &run: runs) {
+            total += run->key_bytes;
+        }
+        return total;
+    }
+
+    uint64_t run_file_bytes() const {
+        uint64_t total = 0;
+        for (auto &run: runs) {
+            total += run->file_bytes;
+        }
+        return total;
+    }
+
+private:
+    // Heap order: smallest key on top, of equal keys the one of the earliest run, so the latest comes last.
+    bool later(size_t a, size_t b) const {
+        const std::vector<char> &ka = runs[a]->key;
+        const std::vector<char> &kb = runs[b]->key;
+        int r = compare_records(ka.data(), ka.size(), kb.data(), kb.size());
+
+        return r != 0 ? r > 0 : a > b;
+    }
+
+    void push_run(size_t run) {
+        heap.push_back(run);
+        std::push_heap(heap.begin(), heap.end(), [this](size_t a, size_t b) { return later(a, b); });
+    }
+
+    void spill() {
+        store.sort();
+        duplicates += store.duplicates;
+        identical += store.identical;
+        store.duplicates = 0;
+        store.identical = 0;
+
+        // a run buffer of 1/64 of the budget keeps a merge of up to 64 runs within it
+        runs.emplace_back(new sort_run_t(dir, std::min<size_t>(1 << 20, std::max<size_t>(64 << 10, memory / 64))));
+        for (const key_store_t::key_t &key: store.keys) {
+            runs.back()->write(store.data(key), key.size);
+        }
+
+        store.clear();
+    }
+};
+
+
+#endif /* __SOS_EXTERNAL_SORT__ */
@@ -15,6 +15,14 @@ extern "C" {
 	  uint32_t   *pc,        /* IN: primary initval, OUT: primary hash */
 	  uint32_t   *pb);       /* IN: secondary initval, OUT: secondary hash */
 
+	// hashlittle2() of n keys of the same length, several at a time in SIMD lanes where the CPU has them
+	void hashlittle2_xN(
+	  const void *const *keys,  /* the keys to hash */
+	  size_t      length,       /* length of each key */
+	  uint32_t   *pc,           /* IN: primary initvals, OUT: primary hashes */
+	  uint32_t   *pb,           /* IN: secondary initvals, OUT: secondary hashes */
+	  size_t      n);           /* number of keys */
+
 }
 
 #endif
@@ -0,0 +1,142 @@
+#ifndef __SOS_KEY_SHARDS__
+#define __SOS_KEY_SHARDS__
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "external_sort.h"
+
+
+/*
+ * Keys routed to one shard, in the order the scan found them. follows marks a key that comes after the
+ * key before it on the same source page, pages counts the source pages that contributed keys.
+ */
+struct key_block_t {
+    struct entry_t {
+        uint32_t size;
+        bool follows;
+    };
+
+    std::vector<char> bytes;
+    std::vector<entry_t> entries;
+    uint32_t pages = 0;
+    int64_t last_page = 0;
+
+    void add(const char *key, uint32_t size, bool follows) {
+        bytes.insert(bytes.end(), key, key + size);
+        entries.push_back({size, follows});
+    }
+
+    void clear() {
+        bytes.clear();
+        entries.clear();
+        pages = 0;
+    }
+};
+
+// Hands blocks from the scan to one shard writer. Holds at most `capacity` blocks, so a slow shard stalls the scan.
+struct key_block_queue_t {
+    std::mutex mutex;
+    std::condition_variable pushed;
+    std::condition_variable popped;
+    std::deque<key_block_t> blocks;
+    size_t capacity = 4;
+    bool closed = false;
+
+    void push(key_block_t &&block) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            popped.wait(lock, [this] { return blocks.size() < capacity; });
+            blocks.push_back(std::move(block));
+        }
+        pushed.notify_one();
+    }
+
+    // False once the queue is closed and drained.
+    bool pop(key_block_t &block) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            pushed.wait(lock, [this] { return !blocks.empty() || closed; });
+
+            if (blocks.empty()) {
+                return false;
+            }
+
+            block = std::move(blocks.front());
+            blocks.pop_front();
+        }
+        popped.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        pushed.notify_all();
+    }
+};
+
+/*
+ * Split points dividing the key space into ranges of about the same number of keys, picked from a sample.
+ * Keys are compared on the fields the restore cursor compares on only, so keys one insert could replace,
+ * and copies of the same key, always land in the same range, and the ranges concatenated in order are a
+ * valid index order.
+ */
+struct key_splits_t {
+    std::vector<std::string> splits;
+
+    static bool well_formed(const char *key, uint32_t size) {
+        record_field_t fields[2];
+        int count = 0;
+        return decode_record(key, size, fields, 2, count);
+    }
+
+    // Picks at most ranges - 1 distinct splits from well-formed sample keys.
+    void pick(std::vector<std::string> &samples, int ranges) {
+        splits.clear();
+
+        std::sort(samples.begin(), samples.end(), [](const std::string &a, const std::string &b) {
+            return compare_key_fields(a.data(), a.size(), b.data(), b.size()) < 0;
+        });
+
+        for (int i = 1; i < ranges; ++i) {
+            size_t position = samples.size() * i / ranges;
+            if (position == 0) {
+                continue;
+            }
+
+            const std::string &split = samples[position];
+
+            if (!splits.empty() &&
+                compare_key_fields(splits.back().data(), splits.back().size(), split.data(), split.size()) == 0) {
+                continue;
+            }
+
+            splits.push_back(split);
+        }
+    }
+
+    size_t ranges() const {
+        return splits.size() + 1;
+    }
+
+    // The range of a well-formed key: the number of splits not greater than it.
+    size_t range_of(const char *key, uint32_t size) const {
+        auto it = std::upper_bound(splits.begin(), splits.end(), key, [size](const char *k, const std::string &s) {
+            return compare_key_fields(k, size, s.data(), s.size()) < 0;
+        });
+
+        return it - splits.begin();
+    }
+};
+
+
+#endif /* __SOS_KEY_SHARDS__ */
@@ -0,0 +1,161 @@
+#ifndef __SOS_PAGE_MAP__
+#define __SOS_PAGE_MAP__
+
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/*
+ * What a classification pass learned about one source page. Stored in a sidecar file next to the
+ * source, so later runs know which pages to read without scanning the whole file again.
+ */
+struct page_map_entry_t {
+    static const uint8_t checksum_checked = 1;
+    static const uint8_t checksum_valid = 2;
+    static const uint8_t zero_page = 4;           // all zero bytes, type is 0
+    static const uint8_t unreadable_page = 16;    // the source failed to read it, type is 0
+
+    uint8_t type = 0;             // first byte of the page, 0x0a and 0x02 for index pages
+    uint8_t flags = 0;
+    uint16_t number_of_cell = 0;  // for index pages
+    uint32_t overflow_head = 0;   // for overflow pages, the first page of the chain they belong to
+    uint32_t overflow_next = 0;   // for overflow pages, the next page of the same chain, 0 where the chain ends
+
+    bool is_index() const {
+        return type == 0x0a || type == 0x02;
+    }
+
+    // Overflow pages start with the next page number, which reads as an index page type from page 0x02000000 on.
+    bool is_overflow() const {
+        return overflow_head != 0;
+    }
+};
+
+static_assert(sizeof(page_map_entry_t) == 12, "page map entries are written to disk as is");
+
+
+struct page_map_header_t {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t reserved_page_size;
+    int64_t source_size;
+    int64_t source_mtime;
+    int64_t page_count;
+};
+
+
+/*
+ * Per-page entries indexed by page number, entry 0 unused. A map is either built in memory by a
+ * classification pass or mapped read-only from its sidecar file. The sidecar is only trusted when
+ * page geometry, size and modification time of the source still match.
+ */
+struct page_map_t {
+    std::vector<page_map_entry_t> built;
+    const page_map_entry_t *entries = nullptr;
+    int64_t page_count = 0;
+
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    page_map_t() = default;
+
+    page_map_t(const page_map_t &) = delete;
+
+    page_map_t &operator=(const page_map_t &) = delete;
+
+    ~page_map_t() {
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    static const char *magic() {
+        return "SOSPMAP3";
+    }
+
+    static std::string sidecar_path(const std::string &source) {
+        return source + ".pagemap";
+    }
+
+    void resize(int64_t pages) {
+        built.assign(pages + 1, page_map_entry_t{});
+        entries = built.data();
+        page_count = pages;
+    }
+
+    const page_map_entry_t &operator[](int64_t pno) const {
+        return entries[pno];
+    }
+
+    bool load(const std::string &path, uint32_t page_size, uint32_t reserved_page_size, const struct stat &source) {
+        int fd = open(path.data(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st{};
+        page_map_header_t header{};
+        bool valid = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                     memcmp(header.magic, magic(), sizeof(header.magic)) == 0 &&
+                     header.page_size == page_size && header.reserved_page_size == reserved_page_size &&
+                     header.source_size == source.st_size && header.source_mtime == source.st_mtime &&
+                     header.page_count == source.st_size / page_size &&
+                     st.st_size == (off_t) (sizeof(header) + (header.page_count + 1) * sizeof(page_map_entry_t));
+
+        if (valid) {
+            mapping_size = st.st_size;
+            mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                valid = false;
+            } else {
+                entries = (const page_map_entry_t *) ((const char *) mapping + sizeof(header));
+                page_count = header.page_count;
+            }
+        }
+
+        close(fd);
+        return valid;
+    }
+
+    // Writes to a temporary file renamed into place, so a crash never leaves a truncated map behind.
+    bool save(const std::string &path, uint32_t page_size, uint32_t reserved_page_size,
+              const struct stat &source) const {
+        page_map_header_t header{};
+        memcpy(header.magic, magic(), sizeof(header.magic));
+        header.page_size = page_size;
+        header.reserved_page_size = reserved_page_size;
+        header.source_size = source.st_size;
+        header.source_mtime = source.st_mtime;
+        header.page_count = page_count;
+
+        std::string temporary = path + ".tmp";
+        FILE *file = fopen(temporary.data(), "wb");
+        if (!file) {
+            return false;
+        }
+
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(entries, sizeof(page_map_entry_t), page_count + 1, file) == (size_t) page_count + 1;
+
+        if (fclose(file) != 0 || !written || rename(temporary.data(), path.data()) != 0) {
+            unlink(temporary.data());
+            return false;
+        }
+
+        return true;
+    }
+};
+
+
+#endif /* __SOS_PAGE_MAP__ */
@@ -0,0 +1,338 @@
+#ifndef __SOS_PAGE_SOURCE__
+#define __SOS_PAGE_SOURCE__
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// Scratch memory for pages read by a page_source_t, aligned so it can be the target of O_DIRECT reads.
+struct page_buffer_t {
+    static const size_t alignment = 4096;
+
+    char *data = nullptr;
+    size_t size = 0;
+
+    page_buffer_t() = default;
+
+    page_buffer_t(const page_buffer_t &) = delete;
+
+    page_buffer_t &operator=(const page_buffer_t &) = delete;
+
+    ~page_buffer_t() {
+        ::free(data);
+    }
+
+    char *reserve(size_t n) {
+        if (n > size) {
+            ::free(data);
+            data = nullptr;
+            size = 0;
+
+            if (posix_memalign((void **) &data, alignment, n) != 0) {
+                throw std::bad_alloc();
+            }
+            size = n;
+        }
+
+        return data;
+    }
+};
+
+
+// True if the page is all zero bytes. Every page size is a multiple of 64, and most pages fail in the first block.
+inline bool is_zero_page(const char *data, size_t size) {
+#if defined(__AVX2__)
+    for (size_t i = 0; i < size; i += 64) {
+        __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (data + i)),
+                                    _mm256_loadu_si256((const __m256i *) (data + i + 32)));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+#elif defined(__SSE2__)
+    for (size_t i = 0; i < size; i += 64) {
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i)),
+                                              _mm_loadu_si128((const __m128i *) (data + i + 16))),
+                                 _mm_or_si128(_mm_loadu_si128((const __m128i *) (data + i + 32)),
+                                              _mm_loadu_si128((const __m128i *) (data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+    }
+#else
+    for (size_t i = 0; i < size; i += 64) {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+
+        if ((words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) != 0) {
+            return false;
+        }
+    }
+#endif
+    return true;
+}
+
+
+/*
+ * Page ranges of the source that are backed by data, from lseek(SEEK_DATA/SEEK_HOLE). Pages wholly inside
+ * a hole read as zeros, so the scan skips them without touching them. Filesystems without hole support
+ * report the whole file as one extent.
+ */
+struct page_extents_t {
+    std::vector<std::pair<int64_t, int64_t>> data;  // [first, last) page numbers, sorted and disjoint
+    int64_t hole_pages = 0;
+
+    void load(int fd, int64_t size, uint64_t page_size) {
+        int64_t page_count = size / page_size;
+        int64_t offset = 0;
+
+        data.clear();
+
+        while (offset < size) {
+            off_t begin = lseek(fd, offset, SEEK_DATA);
+
+            if (begin < 0) {
+                if (errno != ENXIO) {
+                    data.assign(1, {1, page_count + 1});
+                }
+                break;
+            }
+
+            off_t end = lseek(fd, begin, SEEK_HOLE);
+            end = end < 0 ? size : std::min<int64_t>(end, size);
+
+            int64_t first = begin / page_size + 1;
+            int64_t last = (end + page_size - 1) / page_size + 1;
+
+            if (!data.empty() && data.back().second >= first) {
+                data.back().second = std::max(data.back().second, last);
+            } else {
+                data.emplace_back(first, last);
+            }
+
+            offset = end;
+        }
+
+        hole_pages = page_count;
+        for (auto &extent: data) {
+            hole_pages -= std::min(extent.second, page_count + 1) - extent.first;
+        }
+    }
+
+    bool is_hole(int64_t pno) const {
+        auto after = std::upper_bound(data.begin(), data.end(), pno, [](int64_t p, const std::pair<int64_t, int64_t> &e) {
+            return p < e.first;
+        });
+
+        return after == data.begin() || pno >= (after - 1)->second;
+    }
+};
+
+
+/*
+ * Where source pages come from. The scan reads them a chunk at a time; overflow pages, freelist pages
+ * and page 1 are read one at a time. The returned pointer is valid until the buffer is reused, and
+ * backends that address the file directly ignore the buffer.
+ */
+struct page_source_t {
+    virtual ~page_source_t() = default;
+
+    virtual const char *read_chunk(int64_t first_page, int64_t pages, page_buffer_t &buffer) const = 0;
+
+    virtual const char *read_page(int64_t pno, page_buffer_t &buffer) const = 0;
+
+    // Pages the backend failed to read and handed out as zeros instead.
+    virtual bool is_unreadable(int64_t) const {
+        return false;
+    }
+};
+
+
+// The whole file mapped into memory, the page cache does the rest.
+struct mmap_page_source_t : page_source_t {
+    const char *base = nullptr;
+    int64_t size = 0;
+    uint64_t page_size = 0;
+
+    mmap_page_source_t(int fd, int64_t size, uint64_t page_size) : size(size), page_size(page_size) {
+        base = (const char *) mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (base == MAP_FAILED) {
+            throw std::runtime_error("cannot mmap source file");
+        }
+    }
+
+    ~mmap_page_source_t() override {
+        munmap((void *) base, size);
+    }
+
+    const char *read_chunk(int64_t first_page, int64_t, page_buffer_t &) const override {
+        return base + ((first_page - 1) * page_size);
+    }
+
+    const char *read_page(int64_t pno, page_buffer_t &) const override {
+        return base + ((pno - 1) * page_size);
+    }
+};
+
+
+/*
+ * Reads the file with pread into caller buffers, so memory use is bounded by the buffers in flight plus
+ * a small LRU cache for single pages, whatever the file size. Pages already copied out are dropped from
+ * the kernel page cache so the scan does not evict other processes on the host; with O_DIRECT the page
+ * cache is bypassed altogether.
+ */
+struct stream_page_source_t : page_source_t {
+    int fd = -1;
+    int64_t size = 0;
+    uint64_t page_size = 0;
+    bool direct = false;
+
+    size_t cache_pages = 0;
+    mutable std::mutex cache_mutex;
+    mutable std::list<std::pair<int64_t, std::vector<char>>> cache;
+    mutable std::unordered_map<int64_t, std::list<std::pair<int64_t, std::vector<char>>>::iterator> cache_index;
+
+    mutable std::mutex unreadable_mutex;
+    mutable std::unordered_set<int64_t> unreadable;
+
+    stream_page_source_t(const std::string &file, int64_t size, uint64_t page_size, bool direct,
+                         size_t cache_bytes)
+            : size(size), page_size(page_size), direct(direct), cache_pages(cache_bytes / page_size) {
+        fd = open(file.data(), O_RDONLY | (direct ? O_DIRECT : 0));
+
+        if (fd < 0) {
+            throw std::runtime_error("cannot open source file" + std::string(direct ? " with O_DIRECT" : ""));
+        }
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    ~stream_page_source_t() override {
+        close(fd);
+    }
+
+    // Reads [from, to) to data, zero past the end of the file. False on a read error, data is then undefined.
+    bool read_fully(char *data, int64_t from, int64_t to) const {
+        int64_t done = 0;
+
+        while (from + done < to && from + done < size) {
+            ssize_t n = pread(fd, data + done, to - from - done, from + done);
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n < 0) {
+                return false;
+            }
+
+            if (n == 0) {
+                break;
+            }
+
+            done += n;
+        }
+
+        memset(data + done, 0, to - from - done);
+        return true;
+    }
+
+    /*
+     * Reads [offset, offset + length) into buffer, widened to O_DIRECT alignment. Bytes past the end are zero.
+     * When the range fails to read, say on a bad sector, it is read again a page at a time, so only the pages
+     * that cannot be read are lost; those are zero filled and remembered as unreadable.
+     */
+    const char *read_range(int64_t offset, int64_t length, page_buffer_t &buffer) const {
+        int64_t begin = offset & ~(int64_t) (page_buffer_t::alignment - 1);
+        int64_t end = (offset + length + page_buffer_t::alignment - 1) & ~(int64_t) (page_buffer_t::alignment - 1);
+        char *data = buffer.reserve(end - begin);
+
+        if (!read_fully(data, begin, end)) {
+            // with O_DIRECT a read must still cover whole alignment units
+            int64_t unit = std::max<int64_t>(page_size, direct ? page_buffer_t::alignment : 1);
+
+            for (int64_t from = begin; from < end; from += unit) {
+                int64_t to = std::min(end, from + unit);
+
+                if (!read_fully(data + (from - begin), from, to)) {
+                    memset(data + (from - begin), 0, to - from);
+
+                    std::lock_guard<std::mutex> lock(unreadable_mutex);
+                    for (int64_t pno = from / page_size + 1; pno <= (to - 1) / (int64_t) page_size + 1; ++pno) {
+                        unreadable.insert(pno);
+                    }
+                }
+            }
+        }
+
+        if (!direct) {
+            posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+        }
+
+        return data + (offset - begin);
+    }
+
+    bool is_unreadable(int64_t pno) const override {
+        std::lock_guard<std::mutex> lock(unreadable_mutex);
+        return unreadable.count(pno) > 0;
+    }
+
+    const char *read_chunk(int64_t first_page, int64_t pages, page_buffer_t &buffer) const override {
+        return read_range((first_page - 1) * page_size, pages * page_size, buffer);
+    }
+
+    const char *read_page(int64_t pno, page_buffer_t &buffer) const override {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto found = cache_index.find(pno);
+
+            if (found != cache_index.end()) {
+                cache.splice(cache.begin(), cache, found->second);
+                return (const char *) memcpy(buffer.reserve(page_size), found->second->second.data(), page_size);
+            }
+        }
+
+        const char *page = read_range((pno - 1) * page_size, page_size, buffer);
+
+        if (cache_pages > 0 && !is_unreadable(pno)) {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+
+            if (cache_index.count(pno) == 0) {
+                if (cache.size() >= cache_pages) {
+                    cache_index.erase(cache.back().first);
+                    cache.pop_back();
+                }
+
+                cache.emplace_front(pno, std::vector<char>(page, page + page_size));
+                cache_index[pno] = cache.begin();
+            }
+        }
+
+        return page;
+    }
+};
+
+
+#endif /* __SOS_PAGE_SOURCE__ */
@@ -10,9 +10,19 @@
 
 #include <sstream>
 #include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+#include <fstream>
 
 
-#define SQLITE_THREADSAFE 0  // also in sqlite3.amalgamation.c!
+#define SQLITE_THREADSAFE 2  // also in sqlite3.amalgamation.c! every connection stays on one thread
 
 #include "hash3.h"
 
@@ -27,12 +37,119 @@ extern "C" {
 
 
 #include "codec.h"
+#include "template_vfs.h"
+#include "page_source.h"
+#include "page_map.h"
+#include "arena.h"
+#include "external_sort.h"
+#include "bulk_load.h"
+#include "duplicate_filter.h"
+#include "key_shards.h"
+#include "transaction_sizer.h"
+
+/*
+ * Page layout of the source file. Every legal sqlite page size gets its own instantiation, so the page
+ * arithmetic in index_page_t and database_t folds to constants and shifts instead of runtime divides.
+ */
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+struct page_geometry_t {
+    static constexpr uint64_t page_size = PageSize;
+    static constexpr uint64_t reserved_page_size = ReservedPageSize;
+    static constexpr uint64_t usable_size = page_size - reserved_page_size;
+    static constexpr uint64_t max_local = ((usable_size - 12) * 64 / 255) - 23;
+    static constexpr uint64_t min_local = ((usable_size - 12) * 32 / 255) - 23;
+};
+
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+constexpr uint64_t page_geometry_t<PageSize, ReservedPageSize>::page_size;
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+constexpr uint64_t page_geometry_t<PageSize, ReservedPageSize>::reserved_page_size;
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+constexpr uint64_t page_geometry_t<PageSize, ReservedPageSize>::usable_size;
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+constexpr uint64_t page_geometry_t<PageSize, ReservedPageSize>::max_local;
+template<uint32_t PageSize, uint32_t ReservedPageSize>
+constexpr uint64_t page_geometry_t<PageSize, ReservedPageSize>::min_local;
+
+
+/*
+ * Heap allocations made through operator new on the calling thread, counted for the parser metrics. Every
+ * replaceable form is replaced and goes to malloc and free, so memory allocated by one form and freed by
+ * another, as std::stable_sort does with the nothrow form, never mixes our functions with the library's.
+ */
+thread_local uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations += 1;
+
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    allocations += 1;
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
 
-const uint64_t page_size = 4096;
-const uint64_t reserved_page_size = 8;
-const uint64_t usable_size = page_size - reserved_page_size;
-const uint64_t max_local = ((usable_size - 12) * 64 / 255) - 23;
-const uint64_t min_local = ((usable_size - 12) * 32 / 255) - 23;
+
+std::mutex log_mutex;
+
+// Prepended to every line logged by a thread, names the batch job the thread works for.
+thread_local std::string log_prefix;
+
+// --verbose: also log the header of every page decoded and every cell with overflow content.
+bool verbose_log = false;
+
+// One line of output, written in one piece when the temporary dies so lines from worker threads do not interleave.
+struct log_t {
+    std::stringstream ss;
+
+    ~log_t() {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cout << log_prefix << ss.str() << std::endl;
+    }
+
+    template<typename T>
+    log_t &operator<<(const T &value) {
+        ss << value;
+        return *this;
+    }
+};
 
 
 struct index_page_header_t {
@@ -59,9 +176,11 @@ struct index_page_header_t {
 };
 
 struct index_cells_t {
-    std::vector<uint16_t> offsets;
+    arena_vector_t<uint16_t> offsets;
     const char *cell_region_base = nullptr;
 
+    explicit index_cells_t(arena_t &arena) : offsets(arena_allocator_t<uint16_t>(&arena)) {}
+
     std::string to_string() {
         std::stringstream ss;
         ss << "cell count: " << offsets.size() << " ";
@@ -83,25 +202,100 @@ struct index_cells_t {
  */
 struct payload_t {
     uint64_t payload_body_size = 0;
-    std::vector<char> payload;
-    std::vector<uint32_t> overflow_pages;
+    // points into the source page when the whole payload is local, the bytes are not copied
+    const char *local = nullptr;
+    // the payload assembled from the page and its overflow chain, otherwise
+    arena_vector_t<char> payload;
+    arena_vector_t<uint32_t> overflow_pages;
     bool valid = true;
 
+    explicit payload_t(arena_t &arena)
+            : payload(arena_allocator_t<char>(&arena)), overflow_pages(arena_allocator_t<uint32_t>(&arena)) {}
+
+    const char *data() const {
+        return local ? local : payload.data();
+    }
+
+    uint64_t size() const {
+        return local ? payload_body_size : payload.size();
+    }
+
     std::string to_string() {
         std::stringstream ss;
-        ss << "payload body size: " << payload_body_size << ", " << payload.data();
+        ss << "payload body size: " << payload_body_size << ", " << std::string(data(), size());
         return ss.str();
     }
 };
 
+// Converts n big-endian 16-bit cell pointers to host order into offsets, and finds the smallest and the largest.
+inline void load_cell_pointers(const char *pointers, uint32_t n, uint16_t *offsets, uint16_t &low, uint16_t &high) {
+    uint32_t i = 0;
+    low = 0xffff;
+    high = 0;
+
+#if defined(__SSE2__)
+    if (n >= 8) {
+        // SSE2 only compares signed 16-bit lanes, so the values are biased by 0x8000 and back
+        const __m128i bias = _mm_set1_epi16((short) 0x8000);
+        __m128i lows = _mm_set1_epi16(0x7fff);
+        __m128i highs = _mm_set1_epi16((short) 0x8000);
+
+        for (; i + 8 <= n; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (pointers + i * 2));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm_storeu_si128((__m128i *) (offsets + i), v);
+
+            v = _mm_xor_si128(v, bias);
+            lows = _mm_min_epi16(lows, v);
+            highs = _mm_max_epi16(highs, v);
+        }
+
+        uint16_t l[8], h[8];
+        _mm_storeu_si128((__m128i *) l, _mm_xor_si128(lows, bias));
+        _mm_storeu_si128((__m128i *) h, _mm_xor_si128(highs, bias));
+
+        for (int k = 0; k < 8; ++k) {
+            low = std::min(low, l[k]);
+            high = std::max(high, h[k]);
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        offsets[i] = ntohs(*(uint16_t *) (pointers + i * 2));
+        low = std::min(low, offsets[i]);
+        high = std::max(high, offsets[i]);
+    }
+}
+
+// Sets the bits [begin, end) of bitmap, false if one of them was set already.
+inline bool mark_range(uint64_t *bitmap, uint32_t begin, uint32_t end) {
+    for (uint32_t word = begin / 64; word * 64 < end; ++word) {
+        uint32_t from = std::max(begin, word * 64) - word * 64;
+        uint32_t to = std::min(end, word * 64 + 64) - word * 64;
+        uint64_t bits = (to - from == 64 ? ~0ull : (1ull << (to - from)) - 1) << from;
+
+        if (bitmap[word] & bits) {
+            return false;
+        }
+
+        bitmap[word] |= bits;
+    }
+
+    return true;
+}
+
+template<typename geometry_t>
 struct index_page_t {
-    const char *base;
+    const page_source_t *source;
     const char *position;
     const int64_t pno = 0;
 
-    index_page_t(const char *base, int64_t pno) : base(base), pno(pno) {
-        position = base + ((pno - 1) * 4096ll);
-    };
+    // overflow chains resolved by the classification pass, if any
+    const page_map_t *map = nullptr;
+
+    index_page_t(const page_source_t *source, const char *position, int64_t pno, const page_map_t *map = nullptr)
+            : source(source), position(position), pno(pno), map(map) {};
 
     bool is_index_leaf() const {
         return *position == 0x0a;
@@ -126,8 +320,52 @@ struct index_page_t {
         return header;
     }
 
-    index_cells_t get_cells(const index_page_header_t &header, index_page_t &p) const {
-        index_cells_t cs;
+    /*
+     * Structural check of the cell pointer array before anything is decoded: the array has to fit in front of
+     * the cell content area, and every cell has to start inside [cell_region_offset, usable_size) with its
+     * first 4 bytes (the smallest cell sqlite writes) shared with no other cell. The slots are marked on a
+     * bitmap of the page, one bit per byte, so the check is linear in the number of cells.
+     *
+     * The rest of a cell is left to check_cell(): a page that failed its checksum often has one cell with a
+     * garbled payload size, which would overlap its neighbours, and salvage still recovers the others.
+     */
+    bool check_cell_pointers(const index_page_header_t &header) const {
+        uint32_t header_size = is_index_leaf() ? 8 : 12;
+        uint32_t region = header.cell_region_offset ? header.cell_region_offset : 65536;
+        uint32_t n = header.number_of_cell;
+
+        if (region < header_size + n * 2 || region > geometry_t::usable_size ||
+            n * 4 > geometry_t::usable_size - region) {
+            return false;
+        }
+
+        if (n == 0) {
+            return true;
+        }
+
+        uint16_t offsets[geometry_t::usable_size / 4 + 1];
+        uint16_t low, high;
+        load_cell_pointers(position + header_size, n, offsets, low, high);
+
+        if (low < region || high + 4 > geometry_t::usable_size) {
+            return false;
+        }
+
+        // only the words covering the content area are used
+        uint64_t used[(geometry_t::usable_size + 63) / 64];
+        memset(used + region / 64, 0, (sizeof(used) / 8 - region / 64) * 8);
+
+        for (uint32_t i = 0; i < n; ++i) {
+            if (!mark_range(used, offsets[i], offsets[i] + 4)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    index_cells_t get_cells(const index_page_header_t &header, index_page_t &p, arena_t &arena) const {
+        index_cells_t cs(arena);
 
         cs.cell_region_base = position + header.cell_region_offset;
         cs.offsets.resize(header.number_of_cell);
@@ -148,12 +386,12 @@ struct index_page_t {
 
 
     static uint64_t calculate_embed_payload_size(uint64_t payload_body_size) {
-        uint64_t surplus = min_local + ((payload_body_size - min_local) % (usable_size - 4));
+        uint64_t surplus = geometry_t::min_local + ((payload_body_size - geometry_t::min_local) % (geometry_t::usable_size - 4));
 
-        if (surplus <= max_local) {
+        if (surplus <= geometry_t::max_local) {
             return surplus;
         } else {
-            return min_local;
+            return geometry_t::min_local;
         }
     }
 
@@ -163,31 +401,153 @@ struct index_page_t {
      * or zero for the final page in the chain.
      *
      * The fifth byte through the last usable byte are used to hold overflow content.
+     *
+     * Without a page map the chain is followed through those page numbers. The payload size fixes the number
+     * of hops, and the pages visited so far are kept in an open addressing set sized for them, so a chain
+     * that comes back to one of its own pages is dropped at that hop instead of filling the payload.
      */
     void loop_overflow_pages(payload_t &payload, uint64_t done, uint64_t limit) const {
         uint32_t overflow_page_id = payload.overflow_pages[0];
+        static thread_local page_buffer_t scratch;
+
+        if (map) {
+            loop_resolved_overflow_pages(payload, done);
+            return;
+        }
+
+        uint64_t hops = (payload.payload_body_size - done + geometry_t::usable_size - 5) / (geometry_t::usable_size - 4);
+        size_t slots = 16;
+        while (slots < hops * 2) {
+            slots *= 2;
+        }
+
+        arena_vector_t<uint32_t> visited(slots, 0, payload.overflow_pages.get_allocator());
 
         while (payload.payload_body_size > done) {
-            if (overflow_page_id > (limit / 4096 + 1) || overflow_page_id == 0) {
-                std::cout << "ERROR: invalid overflow page id " << overflow_page_id << std::endl;
+            if (overflow_page_id > (limit / geometry_t::page_size + 1) || overflow_page_id < 2) {
+                log_t() << "ERROR: invalid overflow page id " << overflow_page_id;
+                payload.valid = false;
+                return;
+            }
+
+            size_t slot = (overflow_page_id * 0x9e3779b1u) & (slots - 1);
+            while (visited[slot] != 0 && visited[slot] != overflow_page_id) {
+                slot = (slot + 1) & (slots - 1);
+            }
+
+            if (visited[slot] == overflow_page_id) {
+                log_t() << "WARNING: page " << this->pno << " overflow chain " << payload.overflow_pages[0]
+                        << " comes back to page " << overflow_page_id << ", cell dropped";
                 payload.valid = false;
-                assert(!"sanity check");
                 return;
             }
 
-            const char *next_page_position = this->base + ((overflow_page_id - 1) * 4096ll);
+            visited[slot] = overflow_page_id;
+
+            const char *next_page_position = source->read_page(overflow_page_id, scratch);
             overflow_page_id = htonl(*(uint32_t *) next_page_position);
 
             uint64_t todo = payload.payload_body_size - done;
-            todo = todo < usable_size - 4 ? todo : usable_size - 4;
+            todo = todo < geometry_t::usable_size - 4 ? todo : geometry_t::usable_size - 4;
+
+            memcpy(payload.payload.data() + done, next_page_position + 4, todo);
+            done += todo;
+        }
+    }
+
+    /*
+     * Same as loop_overflow_pages(), along a chain resolved by the page map. Every hop is one lookup that
+     * only continues on pages claimed by this chain, so cycles and chains cross-linked with another one
+     * end the walk instead of producing a payload.
+     */
+    void loop_resolved_overflow_pages(payload_t &payload, uint64_t done) const {
+        uint32_t head = payload.overflow_pages[0];
+        uint32_t overflow_page_id = head;
+        static thread_local page_buffer_t scratch;
+
+        if (head > map->page_count || (*map)[head].overflow_head != head) {
+            overflow_page_id = 0;
+        }
 
+        while (payload.payload_body_size > done) {
+            if (overflow_page_id == 0) {
+                log_t() << "WARNING: page " << this->pno << " overflow chain " << head
+                        << " is cyclic, cross-linked or truncated, cell dropped";
+                payload.valid = false;
+                return;
+            }
+
+            const char *next_page_position = source->read_page(overflow_page_id, scratch);
+            overflow_page_id = (*map)[overflow_page_id].overflow_next;
+
+            uint64_t todo = std::min(payload.payload_body_size - done, geometry_t::usable_size - 4);
             memcpy(payload.payload.data() + done, next_page_position + 4, todo);
             done += todo;
         }
     }
 
-    payload_t get_payload(index_cells_t &cells, int index, uint64_t limit) const {
-        payload_t payload{};
+    // Child page numbers of an interior page: the left child of every cell, then the right-most pointer.
+    void get_child_pages(const index_page_header_t &header, const index_cells_t &cells, int64_t page_count,
+                         std::vector<uint32_t> &children) const {
+        for (uint16_t offset: cells.offsets) {
+            if (offset < 12 || offset + 4 > geometry_t::usable_size) {
+                continue;
+            }
+
+            uint32_t child = ntohl(*(uint32_t *) (position + offset));
+            if (child >= 2 && child <= page_count) {
+                children.push_back(child);
+            }
+        }
+
+        if (header.right_most_pointer >= 2 && header.right_most_pointer <= page_count) {
+            children.push_back(header.right_most_pointer);
+        }
+    }
+
+    /*
+     * Checks that a cell lies inside the usable area of the page and that its overflow page id is in range,
+     * trusting nothing on the page. On success overflow_page_id is the head of the overflow chain (0 if the
+     * payload is local) and overflow_size is the number of payload bytes stored in that chain.
+     */
+    bool check_cell(const index_cells_t &cells, int index, uint64_t limit,
+                    uint32_t &overflow_page_id, uint64_t &overflow_size) const {
+        uint64_t header_size = is_index_leaf() ? 8 : 12;
+        uint64_t cell_offset = cells.offsets[index];
+
+        if (cell_offset < header_size + cells.offsets.size() * 2 || cell_offset + 4 >= geometry_t::usable_size) {
+            return false;
+        }
+
+        const char *payload_header_position = position + cell_offset + (is_index_interior() ? 4 : 0);
+        uint64_t payload_body_size = 0;
+        uint64_t payload_body_offset = payload_header_position - position +
+                                       sqlite3GetVarint((const unsigned char *) payload_header_position,
+                                                        (u64 *) &payload_body_size);
+        uint64_t max_embed_payload_size = calculate_embed_payload_size(payload_body_size);
+
+        overflow_page_id = 0;
+        overflow_size = 0;
+
+        if (payload_body_size == 0) {
+            return false;
+        }
+
+        if (payload_body_size <= max_embed_payload_size) {
+            return payload_body_offset + payload_body_size <= geometry_t::usable_size;
+        }
+
+        if (payload_body_offset + max_embed_payload_size + 4 > geometry_t::usable_size) {
+            return false;
+        }
+
+        overflow_page_id = htonl(*(uint32_t *) (position + payload_body_offset + max_embed_payload_size));
+        overflow_size = payload_body_size - max_embed_payload_size;
+        return overflow_page_id >= 2 && overflow_page_id <= limit / geometry_t::page_size;
+    }
+
+    payload_t get_payload(index_cells_t &cells, int index, uint64_t limit, arena_t &arena) const {
+        payload_t payload(arena);
 
         uint16_t cell_offset = cells.offsets[index];
         const char *payload_header_position = position + cell_offset;
@@ -210,22 +570,22 @@ struct index_page_t {
         if (payload.payload_body_size > max_embed_payload_size) {
             // overflow
             uint32_t overflow_page_id = htonl(*(uint32_t *) (payload_body_position + max_embed_payload_size));
-            std::cout << "page: " << this->pno << ", cell: " << index << " has overflow content with page id "
-                      << overflow_page_id << std::endl;
+            if (verbose_log) {
+                log_t() << "page: " << this->pno << ", cell: " << index << " has overflow content with page id "
+                        << overflow_page_id;
+            }
 
             // sanity check
-            if (overflow_page_id > (limit / 4096 + 1)) {
-                std::cout << "ERROR: invalid overflow page id " << overflow_page_id << std::endl;
+            if (overflow_page_id > (limit / geometry_t::page_size + 1)) {
+                log_t() << "ERROR: invalid overflow page id " << overflow_page_id;
                 payload.valid = false;
-                assert(!"sanity check");
                 return std::move(payload);
             }
 
             // sanity check
-            if (payload.payload_body_size > this->position - this->base) {
-                std::cout << "ERROR: payload body is too large " << payload.payload_body_size << std::endl;
+            if (payload.payload_body_size > (this->pno - 1) * geometry_t::page_size) {
+                log_t() << "ERROR: payload body is too large " << payload.payload_body_size;
                 payload.valid = false;
-                assert(!"sanity check");
                 return std::move(payload);
             }
 
@@ -235,49 +595,316 @@ struct index_page_t {
             payload.overflow_pages.push_back(overflow_page_id);
             loop_overflow_pages(payload, max_embed_payload_size, limit);
         } else {
-            payload.payload.resize(payload.payload_body_size);
-            memcpy(payload.payload.data(), payload_body_position, payload.payload_body_size);
+            payload.local = payload_body_position;
         }
 
         return std::move(payload);
     }
 };
 
+template<typename geometry_t>
 struct database_t {
     int fd = 0;
     int64_t size = 0;
-    const char *base = nullptr;
+    const page_source_t *source = nullptr;
+
+    // page types and checksum results of an earlier classification pass, if any
+    const page_map_t *map = nullptr;
+
+    // the parts of a sparse source that hold data
+    const page_extents_t *extents = nullptr;
+
+    // verifies the lookup3 checksum in the reserve area of source pages, written by fdb's own codec
+    page_checksum_codec_t *codec = nullptr;
 
     int64_t get_page_size() const {
-        return size / 4096;
+        return size / geometry_t::page_size;
+    }
+
+    bool is_hole(int64_t pno) const {
+        return extents && extents->is_hole(pno);
+    }
+
+    bool is_overflow(int64_t pno) const {
+        return map && (*map)[pno].is_overflow();
+    }
+
+    // Whether the page could not be read, now or when the page map was built; logs the offset when it could not.
+    bool is_unreadable(int64_t pno) const {
+        if (!source->is_unreadable(pno) && !(map && ((*map)[pno].flags & page_map_entry_t::unreadable_page))) {
+            return false;
+        }
+
+        log_t() << "ERROR: page " << pno << " at offset " << (pno - 1) * geometry_t::page_size
+                << " could not be read, skipped";
+        return true;
+    }
+
+    // position is where the page was read to, from a chunk or from read_page()
+    index_page_t<geometry_t> get_page(int64_t pno, const char *position) const {
+        return index_page_t<geometry_t>{source, position, pno, map};
+    }
+
+    bool verify_page(int64_t pno, const char *position) const {
+        return codec->checksum((Pgno) pno, (void *) position, geometry_t::page_size, false);
+    }
+
+    // verify_page() of n pages at once
+    void verify_pages(const Pgno *pnos, const char *const *positions, int n, bool *valid) const {
+        codec->checksum(pnos, (void *const *) positions, n, geometry_t::page_size, false, valid);
     }
 
-    index_page_t get_page(int64_t pno) const {
-        return index_page_t{base, pno};
+    // An overflow chain is only as trustworthy as every page on it.
+    bool verify_overflow_chain(uint32_t overflow_page_id, uint64_t overflow_size) const {
+        static thread_local page_buffer_t scratch;
+
+        while (overflow_size > 0) {
+            if (overflow_page_id < 2 || overflow_page_id > get_page_size()) {
+                return false;
+            }
+
+            const char *position = source->read_page(overflow_page_id, scratch);
+            if (!verify_page(overflow_page_id, position)) {
+                return false;
+            }
+
+            overflow_size -= std::min(overflow_size, geometry_t::usable_size - 4);
+            overflow_page_id = htonl(*(uint32_t *) position);
+        }
+
+        return true;
     }
 };
 
 
+/*
+ * What to do with a source page whose checksum does not match:
+ *   skip:    do not decode it at all.
+ *   flag:    restore it as usual and report its page number.
+ *   salvage: restore only the cells that are in bounds and whose overflow chains verify, with a warning.
+ */
+enum class checksum_policy_t {
+    off, skip, flag, salvage
+};
+
+
 struct metrics_t {
     uint32_t pages = 0;
     uint32_t skip_pages = 0;
 
     uint64_t cells = 0;
     uint64_t bytes = 0;
+    // cells whose payload could not be assembled, e.g. from a broken overflow chain
+    uint64_t invalid_cells = 0;
+    // index pages whose cell pointers overlap or point outside the cell content area, never decoded
+    uint32_t invalid_pointer_pages = 0;
+
+    uint32_t checksum_verified_pages = 0;
+    uint32_t checksum_skipped_pages = 0;
+    uint32_t checksum_flagged_pages = 0;
+    uint32_t checksum_salvaged_pages = 0;
+    uint64_t salvage_dropped_cells = 0;
+
+    uint32_t reachable_pages = 0;
+    uint32_t orphan_pages = 0;
+    uint32_t free_pages = 0;
+
+    // skipped without decoding: pages in holes of a sparse source, and pages of zeros
+    uint32_t hole_pages = 0;
+    uint32_t zero_pages = 0;
+
+    // pages the source failed to read, handed out as zeros and skipped
+    uint32_t unreadable_pages = 0;
+
+    // pages that look like index pages but belong to an overflow chain, never decoded
+    uint32_t overflow_pages = 0;
+
+    // heap allocations made on the parser threads while decoding pages
+    uint64_t parser_allocations = 0;
+
+    // sorted restore: keys written, equal keys and malformed keys dropped, runs spilled and their size
+    uint64_t sorted_keys = 0;
+    uint64_t sort_duplicates = 0;
+    uint64_t sort_malformed = 0;
+    uint32_t sort_runs = 0;
+    uint64_t sort_run_key_bytes = 0;
+    uint64_t sort_run_file_bytes = 0;
+
+    // pages of the b-tree written by the bulk loader
+    uint64_t bulk_pages = 0;
+
+    // inserts that positioned the cursor, and those that found the key on the leaf of the insert before
+    uint64_t insert_seeks = 0;
+    uint64_t descents_avoided = 0;
+
+    // --skip-duplicates: keys the filter could not rule out as copies, and the copies skipped
+    uint64_t duplicate_checks = 0;
+    uint64_t duplicates_skipped = 0;
+
+    // --shards: key ranges written by their own writer, and the keys routed to the fullest of them
+    uint32_t shards = 0;
+    uint64_t largest_shard_keys = 0;
+
+    // --commit-latency: transactions the sizer ended, and the time their commits took
+    uint64_t sized_transactions = 0;
+    uint64_t sized_commit_ms = 0;
+
+    // checkpoints the writer waited for, and those a background thread ran while the writer went on
+    uint64_t writer_checkpoints = 0;
+    uint64_t writer_checkpoint_ms = 0;
+    uint64_t background_checkpoints = 0;
+    uint64_t background_checkpoint_ms = 0;
+
+    // template files through the sos VFS: writes sqlite made and the writes they reached the file as, syncs
+    // done and skipped, and bytes allocated ahead
+    uint64_t template_writes = 0;
+    uint64_t template_file_writes = 0;
+    uint64_t template_syncs = 0;
+    uint64_t template_syncs_skipped = 0;
+    uint64_t preallocated_bytes = 0;
+
+    // Adds the counters collected by a parser thread.
+    void add(const metrics_t &other) {
+        pages += other.pages;
+        skip_pages += other.skip_pages;
+        cells += other.cells;
+        bytes += other.bytes;
+        invalid_cells += other.invalid_cells;
+        invalid_pointer_pages += other.invalid_pointer_pages;
+        checksum_verified_pages += other.checksum_verified_pages;
+        checksum_skipped_pages += other.checksum_skipped_pages;
+        checksum_flagged_pages += other.checksum_flagged_pages;
+        checksum_salvaged_pages += other.checksum_salvaged_pages;
+        salvage_dropped_cells += other.salvage_dropped_cells;
+        reachable_pages += other.reachable_pages;
+        orphan_pages += other.orphan_pages;
+        free_pages += other.free_pages;
+        hole_pages += other.hole_pages;
+        zero_pages += other.zero_pages;
+        unreadable_pages += other.unreadable_pages;
+        overflow_pages += other.overflow_pages;
+        parser_allocations += other.parser_allocations;
+        sorted_keys += other.sorted_keys;
+        sort_duplicates += other.sort_duplicates;
+        sort_malformed += other.sort_malformed;
+        sort_runs += other.sort_runs;
+        sort_run_key_bytes += other.sort_run_key_bytes;
+        sort_run_file_bytes += other.sort_run_file_bytes;
+        bulk_pages += other.bulk_pages;
+        insert_seeks += other.insert_seeks;
+        descents_avoided += other.descents_avoided;
+        duplicate_checks += other.duplicate_checks;
+        duplicates_skipped += other.duplicates_skipped;
+        shards += other.shards;
+        largest_shard_keys = std::max(largest_shard_keys, other.largest_shard_keys);
+        sized_transactions += other.sized_transactions;
+        sized_commit_ms += other.sized_commit_ms;
+        writer_checkpoints += other.writer_checkpoints;
+        writer_checkpoint_ms += other.writer_checkpoint_ms;
+        background_checkpoints += other.background_checkpoints;
+        background_checkpoint_ms += other.background_checkpoint_ms;
+        template_writes += other.template_writes;
+        template_file_writes += other.template_file_writes;
+        template_syncs += other.template_syncs;
+        template_syncs_skipped += other.template_syncs_skipped;
+        preallocated_bytes += other.preallocated_bytes;
+    }
 
     std::string to_string() const {
         std::stringstream ss;
         ss << "pages: " << pages << ", skip pages: " << skip_pages << ", cells: " << cells << ", bytes: " << bytes
            << std::endl;
+
+        if (invalid_cells > 0 || invalid_pointer_pages > 0) {
+            ss << "invalid cells: " << invalid_cells << ", invalid cell pointer pages: " << invalid_pointer_pages
+               << std::endl;
+        }
+
+        if (checksum_verified_pages > 0) {
+            ss << "checksum verified pages: " << checksum_verified_pages
+               << ", skipped: " << checksum_skipped_pages
+               << ", flagged: " << checksum_flagged_pages
+               << ", salvaged: " << checksum_salvaged_pages
+               << ", salvage dropped cells: " << salvage_dropped_cells << std::endl;
+        }
+
+        if (reachable_pages > 0 || orphan_pages > 0) {
+            ss << "reachable pages: " << reachable_pages << ", orphan pages: " << orphan_pages
+               << ", free pages: " << free_pages << std::endl;
+        }
+
+        ss << "parser allocations: " << parser_allocations << ", per page: "
+           << (pages > 0 ? parser_allocations / (double) pages : 0.0) << std::endl;
+
+        if (hole_pages > 0 || zero_pages > 0) {
+            ss << "hole pages: " << hole_pages << ", zero pages: " << zero_pages << std::endl;
+        }
+
+        if (unreadable_pages > 0) {
+            ss << "unreadable pages: " << unreadable_pages << std::endl;
+        }
+
+        if (overflow_pages > 0) {
+            ss << "overflow pages excluded from the index scan: " << overflow_pages << std::endl;
+        }
+
+        if (sorted_keys > 0 || sort_malformed > 0) {
+            ss << "sorted keys: " << sorted_keys << ", duplicates dropped: " << sort_duplicates
+               << ", malformed dropped: " << sort_malformed << std::endl;
+        }
+
+        if (sort_runs > 0) {
+            ss << "sort runs spilled: " << sort_runs << ", key bytes: " << sort_run_key_bytes << ", run bytes: "
+               << sort_run_file_bytes << std::endl;
+        }
+
+        if (bulk_pages > 0) {
+            ss << "bulk loaded b-tree pages: " << bulk_pages << std::endl;
+        }
+
+        if (duplicate_checks > 0 || duplicates_skipped > 0) {
+            ss << "possible duplicates checked: " << duplicate_checks << ", exact duplicates skipped: "
+               << duplicates_skipped << std::endl;
+        }
+
+        if (shards > 0) {
+            ss << "shards: " << shards << ", keys in the largest shard: " << largest_shard_keys << std::endl;
+        }
+
+        if (sized_transactions > 0) {
+            ss << "sized transactions: " << sized_transactions << ", commit time: " << sized_commit_ms
+               << " ms, per commit: " << sized_commit_ms / (double) sized_transactions << " ms" << std::endl;
+        }
+
+        if (writer_checkpoints > 0 || background_checkpoints > 0) {
+            ss << "checkpoints stalling the writer: " << writer_checkpoints << ", stall time: " << writer_checkpoint_ms
+               << " ms, background checkpoints: " << background_checkpoints << ", background time: "
+               << background_checkpoint_ms << " ms" << std::endl;
+        }
+
+        if (template_writes > 0) {
+            ss << "template writes: " << template_writes << ", written as: " << template_file_writes << ", syncs: "
+               << template_syncs << ", syncs skipped: " << template_syncs_skipped << ", preallocated bytes: "
+               << preallocated_bytes << std::endl;
+        }
+
+        if (insert_seeks > 0) {
+            ss << "insert seeks: " << insert_seeks << ", root-to-leaf descents avoided: " << descents_avoided
+               << std::endl;
+        }
+
         return ss.str();
     }
 };
 
+struct shard_set_t;
+struct checkpointer_t;
+
 struct restore_context_t {
     std::string filename = "template.sqlite";
-    sqlite3 *db;
+    sqlite3 *db = nullptr;
     Btree *btree;
-    BtCursor *cursor;
+    BtCursor *cursor = nullptr;
     page_checksum_codec_t *codec;
     KeyInfo keyInfo;
 
@@ -289,14 +916,98 @@ struct restore_context_t {
     int transaction_in_checkpoint = 0;
     int transaction_per_checkpoint = 10;
 
+    // parser threads feeding this writer, 1 parses inline on the writer thread
+    int threads = 1;
+
+    checksum_policy_t checksum_policy = checksum_policy_t::off;
+
+    // source page geometry, 0 and -1 mean read it from the header on page 1
+    uint32_t page_size = 0;
+    int reserved_page_size = -1;
+
+    // restore pages reachable from a b-tree root first, then (unless skipped) orphan and freed index pages
+    bool reachable_first = false;
+    bool skip_orphans = false;
+
+    // source pages parsed as one batch
+    int64_t pages_per_chunk = 256;
+
+    // read the source with bounded memory instead of mapping all of it
+    bool stream_reader = false;
+    int reader_memory_mb = 256;
+    bool direct_io = false;
+
+    // classify pages once and keep the result in a sidecar file next to the source
+    bool page_map = false;
+
+    // restore the (source, template, start page) lines of a manifest, jobs of them at a time
+    std::string batch_manifest;
+    int jobs = 1;
+
+    // insert the keys in key order instead of page order, sorted within sort_memory_mb and spilled to sort_dir
+    // (default the template's directory) beyond that
+    bool sort_keys = false;
+    int sort_memory_mb = 1024;
+    std::string sort_dir;
+    std::shared_ptr<key_sorter_t> sorter;
+
+    // skip keys already restored byte for byte, ruled out first by a filter of filter_memory_mb
+    bool skip_duplicates = false;
+    int filter_memory_mb = 64;
+    std::shared_ptr<duplicate_filter_t> filter;
+
+    // write the sorted keys as an index b-tree bottom-up into the template, pages filled to fill_factor percent
+    bool bulk_load = false;
+    int fill_factor = 100;
+
+    // split the keys into this many key ranges, insert every range into a temporary b-tree on its own
+    // thread and bulk load the trees one after the other into the template
+    int shards = 0;
+    std::shared_ptr<shard_set_t> shard_set;
+
+    // --offline: the template is not in use, restore without journal, checkpoints and syncs, with a page cache
+    // of cache_memory_mb, and sync once at the end. A restore that dies leaves a broken template behind.
+    bool offline = false;
+    int cache_memory_mb = 1024;
+
+    // end transactions by key bytes aimed at commits of commit_latency_ms, and before they hold
+    // transaction_memory_mb of dirty template pages, instead of every pages_per_transaction source pages
+    int commit_latency_ms = 0;
+    int transaction_memory_mb = 256;
+    std::shared_ptr<transaction_sizer_t> sizer;
+
+    // backfill the WAL on a checkpointer thread once it holds checkpoint_wal_mb, instead of stopping the
+    // writer every transaction_per_checkpoint transactions
+    int checkpoint_wal_mb = 0;
+    std::shared_ptr<checkpointer_t> checkpointer;
+
+    // threads computing the checksums of the template pages a commit or cache spill writes, 1 hashes
+    // every page on the writer as sqlite writes it
+    int checksum_threads = 1;
+
+    // open the template through the sos VFS, see template_vfs.h: combine adjacent writes into writes of up to
+    // write_buffer_kb, allocate preallocate_bytes of it ahead, and sync it as the policy says
+    int write_buffer_kb = 0;
+    bool preallocate = false;
+    uint64_t preallocate_bytes = 0;
+    fsync_policy_t fsync = fsync_policy_t::checkpoint;
+    std::shared_ptr<template_io_t> template_io;
+
     metrics_t metrics;
 };
 
 
+/*
+ * A fatal error of one restore, what() is the line to report. The restore of the command line exits on it,
+ * a batch marks the job failed and goes on with the others.
+ */
+struct restore_error_t : std::runtime_error {
+    explicit restore_error_t(const std::string &message) : std::runtime_error(message) {}
+};
+
 void check_error(const std::string &op, int result) {
     if (result) {
-        std::cout << "sqlite failure, operation: " << op << " message: " << sqlite3ErrStr(result) << std::endl;
-        exit(1);
+        throw restore_error_t("sqlite failure, operation: " + op + " message: " + sqlite3ErrStr(result));
     }
 }
 
@@ -346,16 +1057,23 @@ struct statement_t {
 };
 
 
-void begin_restore(restore_context_t &ctx) {
-    int result = sqlite3_open_v2(ctx.filename.data(), &ctx.db, SQLITE_OPEN_READWRITE, nullptr);
+// Opens the template with a pager codec of its own.
+void open_template(restore_context_t &ctx) {
+    const char *vfs = nullptr;
+
+    if (ctx.template_io) {
+        template_vfs_t::instance().configure(ctx.filename, ctx.template_io);
+        vfs = template_vfs_name;
+    }
+
+    int result = sqlite3_open_v2(ctx.filename.data(), &ctx.db, SQLITE_OPEN_READWRITE, vfs);
     check_error("open", result);
 
     ctx.btree = ctx.db->aDb[0].pBt;
     int r = sqlite3_test_control(SQLITE_TESTCTRL_RESERVE, ctx.db, sizeof(page_checksum_codec_t::sum_type_t));
 
     if (r != 0) {
-        std::cout << "ERROR: sqlite3_test_control() failed" << std::endl;
-        exit(1);
+        throw restore_error_t("ERROR: sqlite3_test_control() failed");
     }
 
     // Always start with a new pager codec with default options.
@@ -364,11 +1082,41 @@ void begin_restore(restore_context_t &ctx) {
                               page_checksum_codec_t::free, ctx.codec);
 
     sqlite3_extended_result_codes(ctx.db, 1);
+}
+
+void start_checkpointer(restore_context_t &ctx);
+
+void begin_restore(restore_context_t &ctx) {
+    if (!ctx.template_io &&
+        (ctx.write_buffer_kb > 0 || ctx.preallocate_bytes > 0 || ctx.fsync != fsync_policy_t::checkpoint)) {
+        ctx.template_io = std::make_shared<template_io_t>();
+        ctx.template_io->write_buffer = (size_t) ctx.write_buffer_kb << 10;
+        ctx.template_io->preallocate = ctx.preallocate_bytes;
+        ctx.template_io->fsync = ctx.fsync;
+    }
+
+    open_template(ctx);
+
+    if (ctx.checksum_threads > 1) {
+        ctx.codec->pool.reset(new worker_pool_t(ctx.checksum_threads));
+        sqlite3BtreePagerSetCodecBatch(ctx.btree, page_checksum_codec_t::codecBatch);
+    }
 
-    statement_t(ctx, "PRAGMA journal_mode = WAL").next_row();
-    statement_t(ctx, "PRAGMA synchronous = NORMAL").execute(); // OFF, NORMAL, FULL
-    statement_t(ctx, "PRAGMA auto_vacuum = NONE").execute();
-    statement_t(ctx, "PRAGMA wal_autocheckpoint = 1").next_row();
+    if (ctx.offline) {
+        // nobody else opens the template: no journal, no syncs until complete_restore(), and a large cache
+        statement_t(ctx, "PRAGMA locking_mode = EXCLUSIVE").next_row();
+        statement_t(ctx, "PRAGMA journal_mode = OFF").next_row();
+        statement_t(ctx, "PRAGMA synchronous = OFF").execute();
+        statement_t(ctx, "PRAGMA auto_vacuum = NONE").execute();
+        statement_t(ctx, ("PRAGMA cache_size = -" + std::to_string(ctx.cache_memory_mb * 1024)).data()).execute();
+    } else {
+        statement_t(ctx, "PRAGMA journal_mode = WAL").next_row();
+        statement_t(ctx, "PRAGMA synchronous = NORMAL").execute(); // OFF, NORMAL, FULL
+        statement_t(ctx, "PRAGMA auto_vacuum = NONE").execute();
+        // only statements run the autocheckpoint hook, commits through the b-tree layer never do
+        statement_t(ctx, ctx.checkpoint_wal_mb > 0 ? "PRAGMA wal_autocheckpoint = 0"
+                                                   : "PRAGMA wal_autocheckpoint = 1").next_row();
+    }
 
 
     ctx.keyInfo.db = ctx.db;
@@ -378,9 +1126,31 @@ void begin_restore(restore_context_t &ctx) {
     ctx.keyInfo.nField = 1;
 
     ctx.cursor = static_cast<BtCursor *>(malloc(sqlite3BtreeCursorSize()));
+
+    if (ctx.commit_latency_ms > 0) {
+        // the first transaction is about as large as a default one of 4 KB source pages
+        ctx.sizer = std::make_shared<transaction_sizer_t>(ctx.commit_latency_ms,
+                                                          (uint64_t) ctx.transaction_memory_mb << 20,
+                                                          (uint64_t) ctx.pages_per_transaction * 4096);
+    }
+
+    if (ctx.checkpoint_wal_mb > 0 && !ctx.offline) {
+        start_checkpointer(ctx);
+    }
 }
 
 
+// The one sync of an offline restore, once the connection is closed.
+void sync_file(const std::string &file) {
+    int fd = open(file.data(), O_RDWR);
+
+    if (fd < 0 || fsync(fd) != 0) {
+        throw restore_error_t("ERROR: cannot sync " + file);
+    }
+
+    close(fd);
+}
+
 void checkpoint(restore_context_t &ctx, bool restart) {
     while (true) {
         int rc = sqlite3_wal_checkpoint_v2(ctx.db, 0, restart ? SQLITE_CHECKPOINT_RESTART : SQLITE_CHECKPOINT_FULL,
@@ -397,94 +1167,1641 @@ void checkpoint(restore_context_t &ctx, bool restart) {
 
 
 void full_checkpoint(restore_context_t &ctx) {
+    auto start = std::chrono::steady_clock::now();
+
     ctx.transaction_in_checkpoint = 0;
     checkpoint(ctx, false);
     checkpoint(ctx, true);
 
-    std::cout << "Checkpoint Done" << std::endl;
-}
-
-void start_transaction(restore_context_t &ctx) {
-    if (ctx.pages_in_transaction > 0) {
-        // transaction already started
-        ctx.pages_in_transaction += 1;
-    } else {
-        ctx.pages_in_transaction = 1;
-        check_error("BtreeBeginTrans", sqlite3BtreeBeginTrans(ctx.btree, true));
+    ctx.metrics.writer_checkpoints += 1;
+    ctx.metrics.writer_checkpoint_ms += std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
 
-        sqlite3BtreeCursorZero(ctx.cursor);
-        check_error("BtreeCursor", sqlite3BtreeCursor(ctx.btree, 3, true, &ctx.keyInfo, ctx.cursor));
-    }
+    log_t() << "Checkpoint Done";
 }
 
-void commit_transaction(restore_context_t &ctx, index_page_t &p) {
-    if (ctx.pages_in_transaction > ctx.pages_per_transaction) {
-        // transaction already started
-        ctx.pages_in_transaction = 0;
-
+/*
+ * --checkpoint-wal: backfills the WAL into the template from a connection of its own, on its own thread,
+ * while the writer goes on appending. A passive checkpoint never waits for the writer and copies every
+ * frame committed before the writer's open transaction.
+ *
+ * The WAL only starts over from its beginning when the writer begins a transaction with every frame
+ * already backfilled, which a writer that never pauses rarely does. Once the WAL grows to four times
+ * the threshold, the writer waits for a checkpoint of the few frames left and the next transaction
+ * starts the WAL over; that wait is the stall time reported.
+ */
+struct checkpointer_t {
+    restore_context_t conn;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable requested;
+    std::condition_variable idle;
+    bool pending = false;
+    bool running = false;
+    bool stop = false;
+
+    uint64_t checkpoints = 0;
+    uint64_t checkpoint_ms = 0;
+
+    // a checkpoint that failed stops the thread, the writer gets the error the next time it asks for one
+    std::exception_ptr error;
+
+    ~checkpointer_t() {
+        try {
+            finish();
+        } catch (...) {
+        }
+    }
+
+    void request() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rethrow_error();
+            pending = true;
+        }
+        requested.notify_one();
+    }
+
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return (!pending && !running) || error; });
+        rethrow_error();
+    }
+
+    void finish() {
+        if (!thread.joinable()) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        requested.notify_one();
+        thread.join();
+
+        check_error("sqlite3_close", sqlite3_close(conn.db));
+        conn.db = nullptr;
+        rethrow_error();
+    }
+
+    void rethrow_error() {
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            error = e;
+            running = false;
+        }
+        idle.notify_all();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            requested.wait(lock, [this] { return pending || stop; });
+
+            if (stop) {
+                break;
+            }
+
+            pending = false;
+            running = true;
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            int frames = 0;
+            int backfilled = 0;
+            int rc = sqlite3_wal_checkpoint_v2(conn.db, 0, SQLITE_CHECKPOINT_PASSIVE, &frames, &backfilled);
+
+            if (rc != SQLITE_OK && (rc & 0xff) != SQLITE_BUSY) {
+                check_error("checkpoint", rc);
+            }
+
+            uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            log_t() << "Background checkpoint: " << backfilled << " of " << frames << " frames backfilled in " << ms
+                    << " ms";
+
+            lock.lock();
+            running = false;
+            checkpoints += 1;
+            checkpoint_ms += ms;
+            idle.notify_all();
+        }
+    }
+};
+
+void start_checkpointer(restore_context_t &ctx) {
+    ctx.checkpointer = std::make_shared<checkpointer_t>();
+    checkpointer_t &checkpointer = *ctx.checkpointer;
+
+    checkpointer.conn.filename = ctx.filename;
+    checkpointer.conn.template_io = ctx.template_io;
+    open_template(checkpointer.conn);
+    // reads the header, which opens the WAL on this connection
+    statement_t(checkpointer.conn, "PRAGMA journal_mode = WAL").next_row();
+
+    checkpointer.thread = std::thread([&checkpointer, prefix = log_prefix + "[checkpointer] "] {
+        log_prefix = prefix;
+
+        try {
+            checkpointer.run();
+        } catch (...) {
+            checkpointer.fail(std::current_exception());
+        }
+    });
+}
+
+// After a commit with --checkpoint-wal: hands a large WAL to the checkpointer, waits for one that kept growing.
+void checkpoint_wal(restore_context_t &ctx) {
+    uint64_t frames = sqlite3BtreeWalFrames(ctx.btree);
+    uint64_t wal_bytes = frames * (sqlite3BtreeGetPageSize(ctx.btree) + 24);
+    uint64_t threshold = (uint64_t) ctx.checkpoint_wal_mb << 20;
+
+    if (wal_bytes >= 4 * threshold) {
+        ctx.checkpointer->wait_idle();
+        log_t() << "WAL of " << wal_bytes << " bytes was not started over, checkpointing on the writer";
+        full_checkpoint(ctx);
+    } else if (wal_bytes >= threshold) {
+        ctx.checkpointer->request();
+    }
+}
+
+// Stops the checkpointer before the last checkpoint, which the writer runs.
+void stop_checkpointer(restore_context_t &ctx) {
+    if (!ctx.checkpointer) {
+        return;
+    }
+
+    ctx.checkpointer->finish();
+    ctx.metrics.background_checkpoints += ctx.checkpointer->checkpoints;
+    ctx.metrics.background_checkpoint_ms += ctx.checkpointer->checkpoint_ms;
+    ctx.checkpointer.reset();
+}
+
+void start_transaction(restore_context_t &ctx) {
+    if (ctx.pages_in_transaction > 0) {
+        // transaction already started
+        ctx.pages_in_transaction += 1;
+    } else {
+        ctx.pages_in_transaction = 1;
+        check_error("BtreeBeginTrans", sqlite3BtreeBeginTrans(ctx.btree, true));
+
+        sqlite3BtreeCursorZero(ctx.cursor);
+        check_error("BtreeCursor", sqlite3BtreeCursor(ctx.btree, 3, true, &ctx.keyInfo, ctx.cursor));
+    }
+}
+
+// Commits once the transaction is full. pno is the source page it ends at, or sorted_keys the number of
+// keys a sorted restore inserted so far.
+void commit_transaction(restore_context_t &ctx, int64_t pno, uint64_t sorted_keys = 0) {
+    uint64_t dirty_pages = ctx.sizer ? sqlite3BtreeDirtyPages(ctx.btree) : 0;
+    bool full = ctx.sizer ? ctx.sizer->full(dirty_pages * sqlite3BtreeGetPageSize(ctx.btree))
+                          : ctx.pages_in_transaction > ctx.pages_per_transaction;
+
+    if (full) {
+        // transaction already started
+        ctx.pages_in_transaction = 0;
+
+        auto start = std::chrono::steady_clock::now();
+
+        check_error("BtreeCloseCursor", sqlite3BtreeCloseCursor(ctx.cursor));
+        check_error("BtreeCommit", sqlite3BtreeCommit(ctx.btree));
+
+        std::string position = sorted_keys > 0 ? std::to_string(sorted_keys) + " sorted keys"
+                                                : "page " + std::to_string(pno);
+
+        if (ctx.sizer) {
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            uint64_t bytes = ctx.sizer->bytes;
+            bool memory_bound = ctx.sizer->memory_bound;
+            double factor = ctx.sizer->committed(ms);
+
+            log_t() << "Committed " << position << ": " << bytes << " key bytes, " << dirty_pages
+                    << " dirty pages" << (memory_bound ? " (memory limit)" : "") << ", commit " << ms
+                    << " ms, next transaction " << ctx.sizer->budget << " key bytes (x" << factor << ")";
+
+            ctx.metrics.sized_transactions += 1;
+            ctx.metrics.sized_commit_ms += (uint64_t) ms;
+        } else {
+            log_t() << "Committed " << position;
+        }
+
+        ctx.transaction_in_checkpoint += 1;
+
+        if (ctx.checkpointer) {
+            checkpoint_wal(ctx);
+        } else if (!ctx.offline && ctx.transaction_in_checkpoint > ctx.transaction_per_checkpoint) {
+            full_checkpoint(ctx);
+        }
+    }
+}
+
+void complete_restore(restore_context_t &ctx) {
+    if (ctx.pages_in_transaction > 0) {
         check_error("BtreeCloseCursor", sqlite3BtreeCloseCursor(ctx.cursor));
         check_error("BtreeCommit", sqlite3BtreeCommit(ctx.btree));
+    }
+
+    if (ctx.offline) {
+        // back to WAL, the journal mode FDB opens the file in
+        statement_t(ctx, "PRAGMA journal_mode = WAL").next_row();
+    } else {
+        stop_checkpointer(ctx);
+        full_checkpoint(ctx);
+    }
+
+    check_error("sqlite3_close", sqlite3_close(ctx.db));
+    ctx.db = nullptr;
+    free(ctx.cursor);
+    ctx.cursor = nullptr;
+
+    // a write or sync the sos VFS could not return to sqlite, such as the sync on close of --fsync=end
+    if (ctx.template_io && ctx.template_io->error) {
+        throw restore_error_t("ERROR: cannot write the template " + ctx.filename + ", " +
+                              sqlite3ErrStr(ctx.template_io->error));
+    }
+
+    // the sos VFS synced the file as it was closed, or is not to sync it at all
+    if (ctx.offline && ctx.fsync == fsync_policy_t::checkpoint) {
+        sync_file(ctx.filename);
+    }
+
+    if (ctx.template_io) {
+        ctx.metrics.template_writes += ctx.template_io->writes;
+        ctx.metrics.template_file_writes += ctx.template_io->file_writes;
+        ctx.metrics.template_syncs += ctx.template_io->syncs;
+        ctx.metrics.template_syncs_skipped += ctx.template_io->syncs_skipped;
+        ctx.metrics.preallocated_bytes += ctx.template_io->preallocated;
+    }
+}
+
+/*
+ * Releases what begin_restore() acquired once a restore failed: stops the checkpointer, closes the
+ * connection, which rolls back the open transaction and closes its cursors, then frees the cursor.
+ * Errors are ignored, the restore already failed. Does nothing after complete_restore().
+ */
+void abort_restore(restore_context_t &ctx) {
+    ctx.checkpointer.reset();
+
+    if (ctx.db) {
+        sqlite3_close(ctx.db);
+        ctx.db = nullptr;
+    }
+
+    free(ctx.cursor);
+    ctx.cursor = nullptr;
+}
+
+
+// An index page decoded by a parser, ready to be inserted by the writer. Local payloads point into the chunk.
+struct parsed_page_t {
+    int64_t pno = 0;
+    uint16_t number_of_cell = 0;
+    arena_vector_t<payload_t> payloads;
+
+    explicit parsed_page_t(arena_t &arena) : payloads(arena_allocator_t<payload_t>(&arena)) {}
+};
+
+/*
+ * What a batch is decoded into: the chunk read from the source, which local payloads point into, and the
+ * arena holding everything else decoded from it. Reused by later batches once the writer is done.
+ */
+struct batch_memory_t {
+    page_buffer_t buffer;
+    arena_t arena;
+};
+
+// Source pages [first_page, last_page), parsed as one unit of work.
+struct page_batch_t {
+    int64_t first_page = 0;
+    int64_t last_page = 0;
+    // pages of the current scan phase, nullptr means every index page
+    const std::vector<bool> *filter = nullptr;
+    metrics_t metrics;
+    std::unique_ptr<batch_memory_t> memory;
+    arena_vector_t<parsed_page_t> pages;
+
+    // Destroys the parsed pages before handing back the memory they live in.
+    std::unique_ptr<batch_memory_t> release() {
+        pages.clear();
+        return std::move(memory);
+    }
+};
+
+/*
+ * Index B-Tree Leaf Cell (header 0x0a):
+ *    A varint which is the total number of bytes of key payload, including any overflow
+ *    The initial portion of the payload that does not spill to overflow pages.
+ *    A 4-byte big-endian integer page_t number for the first page_t of the overflow page_t list - omitted if all payload fits on the b-tree page_t.
+ */
+template<typename geometry_t>
+void parse_index_page(const database_t<geometry_t> &db, index_page_t<geometry_t> &p, parsed_page_t &parsed,
+                      arena_t &arena) {
+    index_page_header_t header = p.get_page_header();
+
+    if (verbose_log) {
+        log_t() << "page: " << p.pno << ", " << header.to_string();
+    }
+
+    index_cells_t cells = p.get_cells(header, p, arena);
+
+    parsed.pno = p.pno;
+    parsed.number_of_cell = header.number_of_cell;
+    parsed.payloads.reserve(header.number_of_cell);
+
+    for (int i = 0; i < header.number_of_cell; ++i) {
+        parsed.payloads.push_back(p.get_payload(cells, i, db.size, arena));
+    }
+}
+
+// Like parse_index_page(), but for a page that failed its checksum: only cells that pass check_cell() are decoded.
+template<typename geometry_t>
+void salvage_index_page(const database_t<geometry_t> &db, index_page_t<geometry_t> &p, parsed_page_t &parsed,
+                        metrics_t &metrics, arena_t &arena) {
+    index_page_header_t header = p.get_page_header();
+
+    parsed.pno = p.pno;
+    parsed.number_of_cell = header.number_of_cell;
+
+    uint64_t header_size = p.is_index_leaf() ? 8 : 12;
+    if (header_size + header.number_of_cell * 2ull > geometry_t::usable_size) {
+        log_t() << "WARNING: page " << p.pno << " checksum mismatch, cell count " << header.number_of_cell
+                << " does not fit, nothing salvaged";
+        metrics.salvage_dropped_cells += header.number_of_cell;
+        return;
+    }
+
+    index_cells_t cells = p.get_cells(header, p, arena);
+
+    for (int i = 0; i < header.number_of_cell; ++i) {
+        uint32_t overflow_page_id;
+        uint64_t overflow_size;
+
+        if (!p.check_cell(cells, i, db.size, overflow_page_id, overflow_size) ||
+            (overflow_page_id != 0 && !db.verify_overflow_chain(overflow_page_id, overflow_size))) {
+            metrics.salvage_dropped_cells += 1;
+            continue;
+        }
+
+        parsed.payloads.push_back(p.get_payload(cells, i, db.size, arena));
+    }
+
+    log_t() << "WARNING: page " << p.pno << " checksum mismatch, salvaged " << parsed.payloads.size() << " of "
+            << header.number_of_cell << " cells";
+}
+
+/*
+ * Verifies the checksums of all candidate pages of a batch in one tight pass before any of them is decoded,
+ * so the hashing streams through the chunk instead of being interleaved with payload copies.
+ */
+template<typename geometry_t>
+void verify_batch(const restore_context_t &ctx, const database_t<geometry_t> &db,
+                  const arena_vector_t<index_page_t<geometry_t>> &candidates, arena_vector_t<bool> &valid,
+                  metrics_t &metrics) {
+    valid.assign(candidates.size(), true);
+
+    if (ctx.checksum_policy == checksum_policy_t::off) {
+        return;
+    }
+
+    // pages the page map has no result for are hashed side by side, a group at a time
+    const int group = 16;
+    Pgno pnos[group];
+    const char *positions[group];
+    size_t indices[group];
+    bool results[group];
+    int count = 0;
+
+    auto verify_group = [&] {
+        db.verify_pages(pnos, positions, count, results);
+        for (int j = 0; j < count; ++j) {
+            valid[indices[j]] = results[j];
+        }
+        count = 0;
+    };
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (db.map && ((*db.map)[candidates[i].pno].flags & page_map_entry_t::checksum_checked)) {
+            valid[i] = (*db.map)[candidates[i].pno].flags & page_map_entry_t::checksum_valid;
+        } else {
+            pnos[count] = (Pgno) candidates[i].pno;
+            positions[count] = candidates[i].position;
+            indices[count] = i;
+            count += 1;
+
+            if (count == group) {
+                verify_group();
+            }
+        }
+    }
+
+    verify_group();
+
+    metrics.checksum_verified_pages += candidates.size();
+}
+
+template<typename geometry_t>
+void parse_chunk(const restore_context_t &ctx, const database_t<geometry_t> &db, page_batch_t &batch) {
+    page_buffer_t &buffer = batch.memory->buffer;
+    arena_t &arena = batch.memory->arena;
+
+    // with a page map, chunks without index pages are never read
+    if (db.map) {
+        int64_t index_pages = 0;
+        int64_t pages = 0;
+
+        for (int64_t i = batch.first_page; i < batch.last_page; ++i) {
+            if (!batch.filter || (*batch.filter)[i]) {
+                pages += 1;
+                index_pages += (*db.map)[i].is_index() && !(*db.map)[i].is_overflow();
+            }
+        }
+
+        if (index_pages == 0) {
+            for (int64_t i = batch.first_page; i < batch.last_page; ++i) {
+                if (!batch.filter || (*batch.filter)[i]) {
+                    batch.metrics.hole_pages += db.is_hole(i);
+                    batch.metrics.zero_pages += !db.is_hole(i) && ((*db.map)[i].flags & page_map_entry_t::zero_page);
+                    batch.metrics.unreadable_pages += !db.is_hole(i) && db.is_unreadable(i);
+                    batch.metrics.overflow_pages += (*db.map)[i].is_index() && (*db.map)[i].is_overflow();
+                }
+            }
+
+            batch.metrics.skip_pages += pages;
+            return;
+        }
+    }
+
+    // only the pages between the first and the last wanted page outside a hole are read
+    int64_t read_first = batch.last_page;
+    int64_t read_last = batch.first_page;
+
+    for (int64_t i = batch.first_page; i < batch.last_page; ++i) {
+        if (batch.filter && !(*batch.filter)[i]) {
+            continue;
+        }
+
+        if (db.is_hole(i)) {
+            batch.metrics.hole_pages += 1;
+            batch.metrics.skip_pages += 1;
+            continue;
+        }
+
+        // pages owned by an overflow chain are never decoded, whatever their first byte says
+        if (db.is_overflow(i)) {
+            batch.metrics.overflow_pages += (*db.map)[i].is_index();
+            batch.metrics.skip_pages += 1;
+            continue;
+        }
+
+        read_first = std::min(read_first, i);
+        read_last = i + 1;
+    }
+
+    if (read_first >= read_last) {
+        return;
+    }
+
+    const char *chunk = db.source->read_chunk(read_first, read_last - read_first, buffer);
+    arena_vector_t<index_page_t<geometry_t>> candidates{arena_allocator_t<index_page_t<geometry_t>>(&arena)};
+    candidates.reserve(read_last - read_first);
+
+    for (int64_t i = read_first; i < read_last; ++i) {
+        if ((batch.filter && !(*batch.filter)[i]) || db.is_hole(i) || db.is_overflow(i)) {
+            continue;
+        }
+
+        index_page_t<geometry_t> p = db.get_page(i, chunk + (i - read_first) * geometry_t::page_size);
+
+        if (db.is_unreadable(i)) {
+            batch.metrics.unreadable_pages += 1;
+            batch.metrics.skip_pages += 1;
+            continue;
+        }
+
+        if (is_zero_page(p.position, geometry_t::page_size)) {
+            batch.metrics.zero_pages += 1;
+            batch.metrics.skip_pages += 1;
+            continue;
+        }
+
+        if (!p.is_index_leaf() && !p.is_index_interior()) {
+            batch.metrics.skip_pages += 1;
+            continue;
+        }
+
+        if (!p.check_cell_pointers(p.get_page_header())) {
+            log_t() << "WARNING: page " << p.pno << " has an invalid cell pointer array, skipped";
+            batch.metrics.invalid_pointer_pages += 1;
+            continue;
+        }
+
+        candidates.push_back(p);
+    }
+
+    arena_vector_t<bool> valid{arena_allocator_t<bool>(&arena)};
+    verify_batch(ctx, db, candidates, valid, batch.metrics);
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        index_page_t<geometry_t> &p = candidates[i];
+
+        if (valid[i]) {
+            batch.pages.emplace_back(arena);
+            parse_index_page(db, p, batch.pages.back(), arena);
+            continue;
+        }
+
+        switch (ctx.checksum_policy) {
+            case checksum_policy_t::skip:
+                log_t() << "WARNING: page " << p.pno << " checksum mismatch, skipped";
+                batch.metrics.checksum_skipped_pages += 1;
+                break;
+
+            case checksum_policy_t::flag:
+                log_t() << "WARNING: page " << p.pno << " checksum mismatch, restored anyway";
+                batch.metrics.checksum_flagged_pages += 1;
+                batch.pages.emplace_back(arena);
+                parse_index_page(db, p, batch.pages.back(), arena);
+                break;
+
+            case checksum_policy_t::salvage:
+                batch.metrics.checksum_salvaged_pages += 1;
+                batch.pages.emplace_back(arena);
+                salvage_index_page(db, p, batch.pages.back(), batch.metrics, arena);
+                break;
+
+            case checksum_policy_t::off:
+                break;
+        }
+    }
+}
+
+// Runs on parser threads: touches only the source and the parser's own chunk buffer, never sqlite state.
+template<typename geometry_t>
+void parse_batch(const restore_context_t &ctx, const database_t<geometry_t> &db, page_batch_t &batch) {
+    uint64_t before = allocations;
+    parse_chunk(ctx, db, batch);
+    batch.metrics.parser_allocations += allocations - before;
+}
+
+/*
+ * Inserts one key. The cursor is positioned from the leaf the previous insert left it on when the key
+ * belongs there, and the insert reuses that seek result instead of descending from the root again.
+ * bias is set when the key likely follows the previous one.
+ */
+void insert_key(restore_context_t &ctx, const char *key, uint32_t size, bool bias) {
+    int loc = 0;
+    int skipped = 0;
+
+    check_error("BtreeMovetoLeaf", sqlite3BtreeMovetoLeaf(ctx.cursor, key, size, bias, &loc, &skipped));
+
+    // for index type btree, payload is the (fdb encoded) key, no value here
+    check_error("BtreeInsert", sqlite3BtreeInsert(ctx.cursor, key, size, nullptr, 0, 0, bias, loc));
+
+    if (ctx.sizer) {
+        ctx.sizer->add(size);
+    }
+
+    ctx.metrics.insert_seeks += 1;
+    ctx.metrics.descents_avoided += skipped;
+}
+
+/*
+ * True if a key with exactly these bytes is already in the tree. Cells that equal the key on the fields
+ * the cursor compares are ordered after it, and copies of keys with more fields never compare equal,
+ * so the check reads forward from where the key would go while the compared fields stay equal.
+ */
+bool key_in_tree(restore_context_t &ctx, const char *key, uint32_t size) {
+    static thread_local std::vector<char> cell;
+    int loc = 0;
+    int skipped = 0;
+    int eof = 0;
+
+    check_error("BtreeMovetoLeaf", sqlite3BtreeMovetoLeaf(ctx.cursor, key, size, 0, &loc, &skipped));
+
+    if (loc < 0) {
+        check_error("BtreeNext", sqlite3BtreeNext(ctx.cursor, &eof));
+    }
+
+    while (!eof && !sqlite3BtreeEof(ctx.cursor)) {
+        i64 n = 0;
+        check_error("BtreeKeySize", sqlite3BtreeKeySize(ctx.cursor, &n));
+        cell.resize(n);
+        check_error("BtreeKey", sqlite3BtreeKey(ctx.cursor, 0, n, cell.data()));
+
+        if (identical_key(cell.data(), n, key, size)) {
+            return true;
+        }
+
+        if (compare_key_fields(cell.data(), n, key, size) != 0) {
+            return false;
+        }
+
+        check_error("BtreeNext", sqlite3BtreeNext(ctx.cursor, &eof));
+    }
+
+    return false;
+}
+
+// Inserts a key unless --skip-duplicates finds an identical copy in the tree. Keys the filter has never
+// seen are new for sure and skip the check.
+void insert_unique_key(restore_context_t &ctx, const char *key, uint32_t size, bool bias) {
+    if (ctx.filter && ctx.filter->test_and_add(duplicate_filter_t::hash(key, size))) {
+        ctx.metrics.duplicate_checks += 1;
+
+        if (key_in_tree(ctx, key, size)) {
+            ctx.metrics.duplicates_skipped += 1;
+            return;
+        }
+    }
+
+    insert_key(ctx, key, size, bias);
+}
 
-        std::cout << "Committed page " << p.pno << std::endl;
+/*
+ * --shards: the writer thread routes every key by its key range to a shard, which inserts it into its own
+ * temporary copy of the template on its own thread, with its own connection, codec and transactions.
+ * Keys reach a shard in blocks, in the order of the scan.
+ */
+struct shard_t {
+    restore_context_t ctx;
+    key_block_queue_t queue;
+    key_block_t pending;
+    bool page_pending = false;  // pending holds a key of the source page being routed
+    uint64_t keys = 0;
+    std::thread thread;
+    std::exception_ptr error;
+};
+
+struct shard_set_t {
+    static const size_t block_bytes = 256 << 10;
+
+    key_splits_t splits;
+    std::vector<std::unique_ptr<shard_t>> shards;
+    uint64_t malformed = 0;
+
+    // the template the shard trees start as copies of, and where the copies go
+    int template_fd = -1;
+    off_t template_size = 0;
+    std::string dir;
+
+    ~shard_set_t() {
+        // a restore that failed before finish_shards() leaves the writers waiting for more keys
+        for (auto &shard: shards) {
+            if (shard->thread.joinable()) {
+                shard->queue.close();
+                shard->thread.join();
+            }
+        }
+
+        // and a bulk load that failed leaves the shard tree it was reading open
+        for (auto &shard: shards) {
+            abort_restore(shard->ctx);
+            unlink(shard->ctx.filename.data());
+            unlink((shard->ctx.filename + "-wal").data());
+            unlink((shard->ctx.filename + "-shm").data());
+        }
+    }
+};
+
+void write_shard(shard_t &shard) {
+    restore_context_t &ctx = shard.ctx;
+    begin_restore(ctx);
+
+    key_block_t block;
+    while (shard.queue.pop(block)) {
+        // a block counts as the source pages it holds keys of, like the keys of a page order restore
+        start_transaction(ctx);
+        ctx.pages_in_transaction += block.pages - 1;
+
+        const char *key = block.bytes.data();
+        for (const key_block_t::entry_t &entry: block.entries) {
+            insert_unique_key(ctx, key, entry.size, entry.follows);
+            key += entry.size;
+        }
+
+        commit_transaction(ctx, block.last_page);
+    }
+
+    complete_restore(ctx);
+}
+
+// Copies the template into the scratch directory, for a shard to insert into.
+std::string copy_template(const shard_set_t &set) {
+    std::string path = set.dir + "/sos-shard-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    std::vector<char> buffer(1 << 20);
+    bool copied = fd >= 0;
+
+    for (off_t offset = 0; copied && offset < set.template_size; offset += buffer.size()) {
+        size_t n = (size_t) std::min<off_t>(buffer.size(), set.template_size - offset);
+        copied = pread(set.template_fd, buffer.data(), n, offset) == (ssize_t) n &&
+                 pwrite(fd, buffer.data(), n, offset) == (ssize_t) n;
+    }
+
+    if (fd < 0 || close(fd) != 0 || !copied) {
+        throw restore_error_t("ERROR: cannot copy the template into " + set.dir);
+    }
+
+    return path;
+}
+
+// Picks the key ranges from the sampled keys and starts a writer thread for each.
+void start_shards(restore_context_t &ctx, std::vector<std::string> &samples) {
+    shard_set_t &set = *ctx.shard_set;
+    set.splits.pick(samples, ctx.shards);
+
+    for (size_t i = 0; i < set.splits.ranges(); ++i) {
+        set.shards.emplace_back(new shard_t());
+        shard_t &shard = *set.shards.back();
+
+        shard.ctx = ctx;
+        shard.ctx.shard_set.reset();
+        shard.ctx.metrics = metrics_t();
+        shard.ctx.filename = copy_template(set);
+        shard.ctx.cache_memory_mb = std::max<int>(1, ctx.cache_memory_mb / set.splits.ranges());
+        shard.ctx.transaction_memory_mb = std::max<int>(1, ctx.transaction_memory_mb / set.splits.ranges());
+        shard.ctx.checksum_threads = std::max<int>(1, ctx.checksum_threads / set.splits.ranges());
+        // scratch copies, deleted once bulk loaded: never synced, and not the file the estimate is for
+        shard.ctx.fsync = fsync_policy_t::off;
+        shard.ctx.preallocate_bytes = 0;
+        shard.ctx.template_io.reset();
+
+        if (ctx.skip_duplicates) {
+            size_t memory = std::max<size_t>(1 << 20, ((size_t) ctx.filter_memory_mb << 20) / set.splits.ranges());
+            shard.ctx.filter = std::make_shared<duplicate_filter_t>(memory);
+        }
+
+        shard.thread = std::thread([&shard, prefix = log_prefix + "[shard " + std::to_string(i) + "] "] {
+            log_prefix = prefix;
+
+            try {
+                write_shard(shard);
+            } catch (...) {
+                shard.error = std::current_exception();
+                abort_restore(shard.ctx);
+
+                // keeps taking blocks, so the router never waits on a shard that is gone
+                key_block_t block;
+                while (shard.queue.pop(block)) {
+                }
+            }
+        });
+    }
+
+    log_t() << "Shards: " << set.splits.ranges() << " key ranges split at " << samples.size() << " sampled keys";
+}
+
+// Runs on the writer thread. Keys the ranges cannot be compared on are dropped, as by --bulk-load.
+void route_key(restore_context_t &ctx, const char *key, uint32_t size) {
+    shard_set_t &set = *ctx.shard_set;
+
+    if (!key_splits_t::well_formed(key, size)) {
+        set.malformed += 1;
+        return;
+    }
+
+    shard_t &shard = *set.shards[set.splits.range_of(key, size)];
+    shard.pending.add(key, size, shard.page_pending);
+    shard.page_pending = true;
+    shard.keys += 1;
+}
+
+void end_routed_page(restore_context_t &ctx, int64_t pno) {
+    for (auto &shard: ctx.shard_set->shards) {
+        if (!shard->page_pending) {
+            continue;
+        }
+
+        shard->page_pending = false;
+        shard->pending.pages += 1;
+        shard->pending.last_page = pno;
+
+        if (shard->pending.bytes.size() >= shard_set_t::block_bytes) {
+            shard->queue.push(std::move(shard->pending));
+            shard->pending = key_block_t();
+        }
+    }
+}
+
+// Hands the last blocks to the shards and waits until every shard tree is complete.
+void finish_shards(restore_context_t &ctx) {
+    shard_set_t &set = *ctx.shard_set;
+
+    for (auto &shard: set.shards) {
+        if (!shard->pending.entries.empty()) {
+            shard->queue.push(std::move(shard->pending));
+        }
+        shard->queue.close();
+    }
+
+    for (auto &shard: set.shards) {
+        shard->thread.join();
+
+        ctx.metrics.add(shard->ctx.metrics);
+        ctx.metrics.largest_shard_keys = std::max(ctx.metrics.largest_shard_keys, shard->keys);
+    }
+
+    for (auto &shard: set.shards) {
+        if (shard->error) {
+            std::rethrow_exception(shard->error);
+        }
+    }
+
+    ctx.metrics.shards += set.shards.size();
+    ctx.metrics.sort_malformed += set.malformed;
+}
+
+void restore_page(restore_context_t &ctx, parsed_page_t &page) {
+    // sorted and sharded restores insert the keys elsewhere, later or on other threads
+    bool collect = ctx.sorter || ctx.shard_set;
+
+    if (!collect) {
+        start_transaction(ctx);
+    }
+
+    ctx.metrics.pages += 1;
+    ctx.metrics.cells += page.number_of_cell;
+
+    // cells of a page are in key order, every key after the first follows the one inserted before it
+    bool follows = false;
+
+    for (payload_t &payload: page.payloads) {
+        if (!payload.valid) {
+            ctx.metrics.invalid_cells += 1;
+            continue;
+        }
+
+        if (payload.payload_body_size == 0) {
+            continue;
+        }
+
+        ctx.metrics.bytes += payload.size();
+
+        if (ctx.sorter) {
+            ctx.sorter->add(payload.data(), payload.size());
+            continue;
+        }
+
+        if (ctx.shard_set) {
+            route_key(ctx, payload.data(), payload.size());
+            continue;
+        }
+
+        insert_unique_key(ctx, payload.data(), payload.size(), follows);
+        follows = true;
+    }
+
+    if (ctx.shard_set) {
+        end_routed_page(ctx, page.pno);
+    }
+
+    if (!collect) {
+        commit_transaction(ctx, page.pno);
+    }
+}
+
+// Runs on the writer thread, which alone owns the connection, the cursor and the transactions.
+void restore_batch(restore_context_t &ctx, page_batch_t &batch) {
+    ctx.metrics.add(batch.metrics);
+
+    for (parsed_page_t &page: batch.pages) {
+        restore_page(ctx, page);
+    }
+}
+
+/*
+ * Hands chunks of the page range to parser threads and returns the parsed batches to the writer
+ * in chunk order, so inserts happen in exactly the order of a serial scan. Parsers may run at
+ * most `window` chunks ahead of the writer, which bounds the memory held by parsed payloads.
+ */
+struct batch_queue_t {
+    std::mutex mutex;
+    std::condition_variable parsed;
+    std::condition_variable consumed;
+    std::map<int64_t, page_batch_t> batches;
+
+    int64_t chunks = 0;
+    int64_t window = 0;
+    int64_t next_parse = 0;
+    int64_t next_restore = 0;
+
+    // memory of restored batches, for the next chunks to be decoded into
+    std::vector<std::unique_ptr<batch_memory_t>> memory;
+
+    bool take_chunk(int64_t &chunk) {
+        std::unique_lock<std::mutex> lock(mutex);
+        consumed.wait(lock, [this] { return next_parse >= chunks || next_parse < next_restore + window; });
+
+        if (next_parse >= chunks) {
+            return false;
+        }
+
+        chunk = next_parse++;
+        return true;
+    }
+
+    void put_batch(int64_t chunk, page_batch_t &&batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.emplace(chunk, std::move(batch));
+        }
+        parsed.notify_one();
+    }
+
+    page_batch_t get_batch(int64_t chunk) {
+        page_batch_t batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            parsed.wait(lock, [this, chunk] { return batches.count(chunk) != 0; });
+
+            batch = std::move(batches[chunk]);
+            batches.erase(chunk);
+            next_restore = chunk + 1;
+        }
+        consumed.notify_all();
+        return batch;
+    }
+
+    std::unique_ptr<batch_memory_t> take_memory() {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (memory.empty()) {
+            return std::unique_ptr<batch_memory_t>(new batch_memory_t());
+        }
+
+        std::unique_ptr<batch_memory_t> free = std::move(memory.back());
+        memory.pop_back();
+        return free;
+    }
+
+    void return_memory(std::unique_ptr<batch_memory_t> free) {
+        std::lock_guard<std::mutex> lock(mutex);
+        memory.push_back(std::move(free));
+    }
+
+    // The writer failed: parsers take no more chunks.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            chunks = std::min(chunks, next_parse);
+        }
+        consumed.notify_all();
+    }
+};
+
+// Runs fn(chunk) for every chunk in [0, chunks) on `threads` threads, in no particular order.
+template<typename F>
+void for_each_chunk(int threads, int64_t chunks, F &&fn) {
+    std::atomic<int64_t> next{0};
+
+    auto worker = [&next, chunks, &fn, prefix = log_prefix] {
+        log_prefix = prefix;
+
+        for (int64_t chunk = next++; chunk < chunks; chunk = next++) {
+            fn(chunk);
+        }
+    };
+
+    if (threads == 1) {
+        worker();
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    for (std::thread &w: workers) {
+        w.join();
+    }
+}
+
+/*
+ * Classification pass: reads every page once and records its type, cell count, checksum result and,
+ * for overflow pages, the first page of their chain and the next page on it. Chains are followed
+ * through the first four bytes of every page, collected in the same pass, so walking them needs no
+ * further reads.
+ *
+ * Every page belongs to at most one chain: the first chain to reach it, in scan order, claims it.
+ * A chain that runs into a page it or another chain already claimed, or out of the file, is cut there
+ * and its head marked broken. overflow_next only links pages claimed by the same chain, so following
+ * it from a head always ends, after at most as many pages as the chain claimed.
+ */
+template<typename geometry_t>
+void build_page_map(const restore_context_t &ctx, const database_t<geometry_t> &db, page_map_t &map) {
+    int64_t page_count = db.get_page_size();
+    int64_t chunks = (page_count + ctx.pages_per_chunk - 1) / ctx.pages_per_chunk;
+    bool checksums = geometry_t::reserved_page_size == sizeof(page_checksum_codec_t::sum_type_t);
+
+    map.resize(page_count);
+    page_map_entry_t *entries = map.built.data();
+
+    std::vector<uint32_t> next(page_count + 1);
+    std::vector<std::vector<std::pair<uint32_t, uint64_t>>> chunk_chains(chunks);
+
+    for_each_chunk(ctx.threads, chunks, [&](int64_t chunk) {
+        page_buffer_t buffer;
+        arena_t arena;
+
+        int64_t first_page = 1 + chunk * ctx.pages_per_chunk;
+        int64_t last_page = std::min(page_count + 1, first_page + ctx.pages_per_chunk);
+        const char *pages = db.source->read_chunk(first_page, last_page - first_page, buffer);
+
+        for (int64_t i = first_page; i < last_page; ++i) {
+            if (db.is_hole(i)) {
+                continue;
+            }
+
+            index_page_t<geometry_t> p = db.get_page(i, pages + (i - first_page) * geometry_t::page_size);
+            page_map_entry_t &entry = entries[i];
+
+            // not persisted as a zero page, so later runs count it as unreadable rather than as zeros
+            if (db.source->is_unreadable(i)) {
+                entry.flags = page_map_entry_t::unreadable_page;
+                continue;
+            }
+
+            if (is_zero_page(p.position, geometry_t::page_size)) {
+                entry.flags = page_map_entry_t::zero_page;
+                continue;
+            }
+
+            entry.type = *p.position;
+            next[i] = ntohl(*(uint32_t *) p.position);
+
+            // page 1 is checksummed as a default-sized page, see page_checksum_codec_t::codec()
+            if (checksums && i != 1) {
+                entry.flags = page_map_entry_t::checksum_checked |
+                              (db.verify_page(i, p.position) ? page_map_entry_t::checksum_valid : 0);
+            }
+
+            if (i == 1 || !entry.is_index()) {
+                continue;
+            }
+
+            index_page_header_t header = p.get_page_header();
+            entry.number_of_cell = header.number_of_cell;
+
+            if (!p.check_cell_pointers(header)) {
+                continue;
+            }
+
+            arena.reset();
+            index_cells_t cells = p.get_cells(header, p, arena);
+
+            for (int k = 0; k < header.number_of_cell; ++k) {
+                uint32_t overflow_page_id;
+                uint64_t overflow_size;
+
+                if (p.check_cell(cells, k, db.size, overflow_page_id, overflow_size) && overflow_page_id != 0) {
+                    chunk_chains[chunk].emplace_back(overflow_page_id, overflow_size);
+                }
+            }
+        }
+    });
+
+    // cells sharing a chain are resolved once, for the longest of them
+    std::unordered_map<uint32_t, uint64_t> longest;
+    for (auto &chains: chunk_chains) {
+        for (auto &chain: chains) {
+            uint64_t &size = longest[chain.first];
+            size = std::max(size, chain.second);
+        }
+    }
+
+    uint64_t broken = 0;
+
+    for (auto &chains: chunk_chains) {
+        for (auto &chain: chains) {
+            auto found = longest.find(chain.first);
+            if (found == longest.end()) {
+                continue;
+            }
+
+            uint32_t pno = chain.first;
+            uint32_t previous = 0;
+            uint64_t remaining = found->second;
+            longest.erase(found);
+
+            while (remaining > 0) {
+                if (pno < 2 || pno > page_count || entries[pno].overflow_head != 0) {
+                    broken += 1;
+                    break;
+                }
+
+                entries[pno].overflow_head = chain.first;
+                if (previous != 0) {
+                    entries[previous].overflow_next = pno;
+                }
+
+                previous = pno;
+                remaining -= std::min(remaining, geometry_t::usable_size - 4);
+                pno = next[pno];
+            }
+        }
+    }
+
+    if (broken > 0) {
+        log_t() << "Page map: " << broken << " overflow chains are cyclic, cross-linked or truncated";
+    }
+}
+
+// Maps the sidecar page map of the source if it is still current, builds and saves a new one otherwise.
+template<typename geometry_t>
+void open_page_map(const restore_context_t &ctx, const database_t<geometry_t> &db, const std::string &file,
+                   const struct stat &st, page_map_t &map) {
+    std::string path = page_map_t::sidecar_path(file);
+    auto begin = std::chrono::steady_clock::now();
+
+    if (map.load(path, geometry_t::page_size, geometry_t::reserved_page_size, st)) {
+        log_t() << "Page map: loaded " << path << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - begin).count() << " ms";
+        return;
+    }
+
+    build_page_map(ctx, db, map);
+
+    log_t() << "Page map: classified " << map.page_count << " pages in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - begin).count() << " ms";
+
+    if (!map.save(path, geometry_t::page_size, geometry_t::reserved_page_size, st)) {
+        log_t() << "WARNING: cannot write page map " << path;
+    }
+}
+
+/*
+ * B-tree topology of the source, rebuilt from the child pointers of interior pages. Freed pages keep
+ * their old content, so index pages that hang off no live interior page are most likely stale copies
+ * of keys that are also stored, or were deleted, elsewhere.
+ */
+struct page_topology_t {
+    std::vector<bool> reachable;
+    std::vector<bool> orphan;
+};
+
+/*
+ * Marks the pages on the freelist. Page 1 holds the first freelist trunk page at offset 32; a trunk page
+ * holds the next trunk page, the number of leaf pages on it and then their page numbers.
+ */
+template<typename geometry_t>
+void read_freelist(const database_t<geometry_t> &db, std::vector<bool> &free) {
+    int64_t page_count = db.get_page_size();
+
+    if (page_count < 2) {
+        return;
+    }
+
+    page_buffer_t scratch;
+    uint32_t trunk = ntohl(*(uint32_t *) (db.source->read_page(1, scratch) + 32));
+
+    while (trunk >= 2 && trunk <= page_count && !free[trunk]) {
+        free[trunk] = true;
+
+        const char *position = db.source->read_page(trunk, scratch);
+        uint64_t leaves = std::min<uint64_t>(ntohl(*(uint32_t *) (position + 4)), geometry_t::usable_size / 4 - 2);
+
+        for (uint64_t i = 0; i < leaves; ++i) {
+            uint32_t leaf = ntohl(*(uint32_t *) (position + 8 + i * 4));
+            if (leaf >= 2 && leaf <= page_count) {
+                free[leaf] = true;
+            }
+        }
+
+        trunk = ntohl(*(uint32_t *) position);
+    }
+}
+
+/*
+ * Reads the header and child pointers of every page, then walks down from the roots: index pages that are
+ * not on the freelist and not referenced by any live interior page. Everything the walk reaches is
+ * reachable, every other index page from start_page on is an orphan.
+ */
+template<typename geometry_t>
+void build_topology(restore_context_t &ctx, const database_t<geometry_t> &db, page_topology_t &topology) {
+    int64_t page_count = db.get_page_size();
+    int64_t chunks = (page_count + ctx.pages_per_chunk - 1) / ctx.pages_per_chunk;
+
+    std::vector<bool> free(page_count + 1);
+    read_freelist(db, free);
+
+    std::vector<uint8_t> index_pages(page_count + 1);
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> chunk_edges(chunks);
+    std::vector<uint8_t> zero(page_count + 1);
+    std::vector<uint8_t> unreadable(page_count + 1);
+
+    for_each_chunk(ctx.threads, chunks, [&](int64_t chunk) {
+        std::vector<uint32_t> children;
+        page_buffer_t buffer;
+        arena_t arena;
+
+        int64_t first_page = 1 + chunk * ctx.pages_per_chunk;
+        int64_t last_page = std::min(page_count + 1, first_page + ctx.pages_per_chunk);
+
+        // with a page map, only chunks holding live interior pages are read
+        if (db.map) {
+            bool interior = false;
+
+            for (int64_t i = std::max<int64_t>(first_page, 2); i < last_page; ++i) {
+                index_pages[i] = (*db.map)[i].is_index() && !(*db.map)[i].is_overflow();
+                zero[i] = (*db.map)[i].flags & page_map_entry_t::zero_page;
+                unreadable[i] = (*db.map)[i].flags & page_map_entry_t::unreadable_page;
+                interior = interior || ((*db.map)[i].type == 0x02 && !(*db.map)[i].is_overflow() && !free[i]);
+            }
+
+            if (!interior) {
+                return;
+            }
+        }
+
+        const char *pages = db.source->read_chunk(first_page, last_page - first_page, buffer);
+
+        for (int64_t i = std::max<int64_t>(first_page, 2); i < last_page; ++i) {
+            if (db.is_hole(i) || db.is_overflow(i)) {
+                continue;
+            }
+
+            index_page_t<geometry_t> p = db.get_page(i, pages + (i - first_page) * geometry_t::page_size);
+
+            if (db.source->is_unreadable(i)) {
+                unreadable[i] = true;
+                continue;
+            }
+
+            if (is_zero_page(p.position, geometry_t::page_size)) {
+                zero[i] = true;
+                continue;
+            }
+
+            if (!p.is_index_leaf() && !p.is_index_interior()) {
+                continue;
+            }
+
+            index_pages[i] = 1;
+
+            if (p.is_index_leaf() || free[i]) {
+                continue;
+            }
+
+            index_page_header_t header = p.get_page_header();
+            if (!p.check_cell_pointers(header)) {
+                continue;
+            }
+
+            arena.reset();
+            index_cells_t cells = p.get_cells(header, p, arena);
+            children.clear();
+            p.get_child_pages(header, cells, page_count, children);
+
+            for (uint32_t child: children) {
+                chunk_edges[chunk].emplace_back(i, child);
+            }
+        }
+    });
+
+    // children of every interior page, in compressed sparse row form
+    std::vector<uint32_t> first_child(page_count + 2);
+    std::vector<bool> referenced(page_count + 1);
+
+    for (auto &edges: chunk_edges) {
+        for (auto &edge: edges) {
+            first_child[edge.first + 1] += 1;
+            referenced[edge.second] = true;
+        }
+    }
+
+    for (int64_t i = 1; i <= page_count + 1; ++i) {
+        first_child[i] += first_child[i - 1];
+    }
+
+    std::vector<uint32_t> children(first_child[page_count + 1]);
+    std::vector<uint32_t> filled(first_child.begin(), first_child.end() - 1);
+
+    for (auto &edges: chunk_edges) {
+        for (auto &edge: edges) {
+            children[filled[edge.first]++] = edge.second;
+        }
+        std::vector<std::pair<uint32_t, uint32_t>>().swap(edges);
+    }
+
+    topology.reachable.assign(page_count + 1, false);
+    topology.orphan.assign(page_count + 1, false);
+
+    std::vector<uint32_t> queue;
+    for (int64_t i = 2; i <= page_count; ++i) {
+        if (index_pages[i] && !free[i] && !referenced[i]) {
+            topology.reachable[i] = true;
+            queue.push_back(i);
+        }
+    }
+
+    uint32_t roots = queue.size();
+
+    while (!queue.empty()) {
+        uint32_t parent = queue.back();
+        queue.pop_back();
+
+        for (uint32_t i = first_child[parent]; i < first_child[parent + 1]; ++i) {
+            uint32_t child = children[i];
+
+            if (index_pages[child] && !free[child] && !topology.reachable[child]) {
+                topology.reachable[child] = true;
+                queue.push_back(child);
+            }
+        }
+    }
+
+    for (int64_t i = 2; i <= page_count; ++i) {
+        if (free[i] && i >= ctx.start_page) {
+            ctx.metrics.free_pages += 1;
+        }
+
+        if (i < ctx.start_page) {
+            topology.reachable[i] = false;
+        } else if (!index_pages[i]) {
+            ctx.metrics.skip_pages += 1;
+            ctx.metrics.hole_pages += db.is_hole(i);
+            ctx.metrics.zero_pages += zero[i] && !db.is_hole(i);
+            ctx.metrics.unreadable_pages += unreadable[i] && !db.is_hole(i) && db.is_unreadable(i);
+            ctx.metrics.overflow_pages += db.is_overflow(i) && (*db.map)[i].is_index();
+        } else if (topology.reachable[i]) {
+            ctx.metrics.reachable_pages += 1;
+        } else {
+            topology.orphan[i] = true;
+            ctx.metrics.orphan_pages += 1;
+        }
+    }
+
+    log_t() << "Topology: roots: " << roots << ", reachable pages: " << ctx.metrics.reachable_pages
+            << ", orphan pages: " << ctx.metrics.orphan_pages << ", free pages: " << ctx.metrics.free_pages;
+}
+
+template<typename geometry_t>
+page_batch_t make_batch(const restore_context_t &ctx, const database_t<geometry_t> &db, int64_t chunk,
+                        const std::vector<bool> *filter, std::unique_ptr<batch_memory_t> memory) {
+    page_batch_t batch;
+    batch.first_page = ctx.start_page + chunk * ctx.pages_per_chunk;
+    batch.last_page = std::min(batch.first_page + ctx.pages_per_chunk, db.get_page_size() + 1);
+    batch.filter = filter;
+
+    memory->arena.reset();
+    batch.pages = arena_vector_t<parsed_page_t>(arena_allocator_t<parsed_page_t>(&memory->arena));
+    batch.memory = std::move(memory);
+    return batch;
+}
+
+template<typename geometry_t>
+void scan_pages(restore_context_t &ctx, const database_t<geometry_t> &db, const std::vector<bool> *filter) {
+    int64_t pages = db.get_page_size() + 1 - ctx.start_page;
+    int64_t chunks = pages > 0 ? (pages + ctx.pages_per_chunk - 1) / ctx.pages_per_chunk : 0;
+
+    if (ctx.threads == 1) {
+        std::unique_ptr<batch_memory_t> memory(new batch_memory_t());
+
+        for (int64_t chunk = 0; chunk < chunks; ++chunk) {
+            page_batch_t batch = make_batch(ctx, db, chunk, filter, std::move(memory));
+            parse_batch(ctx, db, batch);
+            restore_batch(ctx, batch);
+            memory = batch.release();
+        }
+        return;
+    }
+
+    batch_queue_t queue;
+    queue.chunks = chunks;
+    queue.window = ctx.threads * 4;
+
+    std::vector<std::thread> parsers;
+    for (int i = 0; i < ctx.threads; ++i) {
+        parsers.emplace_back([&ctx, &db, &queue, filter, prefix = log_prefix] {
+            log_prefix = prefix;
+            int64_t chunk;
+
+            while (queue.take_chunk(chunk)) {
+                page_batch_t batch = make_batch(ctx, db, chunk, filter, queue.take_memory());
+                parse_batch(ctx, db, batch);
+                queue.put_batch(chunk, std::move(batch));
+            }
+        });
+    }
+
+    try {
+        for (int64_t chunk = 0; chunk < chunks; ++chunk) {
+            page_batch_t batch = queue.get_batch(chunk);
+            restore_batch(ctx, batch);
+            queue.return_memory(batch.release());
+        }
+    } catch (...) {
+        queue.stop();
+
+        for (std::thread &parser: parsers) {
+            parser.join();
+        }
+        throw;
+    }
+
+    for (std::thread &parser: parsers) {
+        parser.join();
+    }
+}
 
-        ctx.transaction_in_checkpoint += 1;
+/*
+ * Parses chunks spread evenly over the source, at most 64 thousand keys in all, and picks the key ranges
+ * of --shards from their keys before the scan routes any key.
+ */
+template<typename geometry_t>
+void sample_shard_splits(restore_context_t &ctx, const database_t<geometry_t> &db) {
+    int64_t pages = db.get_page_size() + 1 - ctx.start_page;
+    int64_t chunks = pages > 0 ? (pages + ctx.pages_per_chunk - 1) / ctx.pages_per_chunk : 0;
+    int64_t sampled = std::min<int64_t>(chunks, std::max(64, ctx.shards * 16));
+    size_t keys_per_chunk = std::max<size_t>(16, 65536 / std::max<int64_t>(1, sampled));
+
+    std::vector<std::vector<std::string>> keys(sampled);
+
+    for_each_chunk(ctx.threads, sampled, [&](int64_t i) {
+        page_batch_t batch = make_batch(ctx, db, i * chunks / sampled, nullptr,
+                                        std::unique_ptr<batch_memory_t>(new batch_memory_t()));
+        parse_batch(ctx, db, batch);
+
+        std::vector<std::string> found;
+        for (parsed_page_t &page: batch.pages) {
+            for (payload_t &payload: page.payloads) {
+                if (payload.valid && payload.payload_body_size != 0 &&
+                    key_splits_t::well_formed(payload.data(), payload.size())) {
+                    found.emplace_back(payload.data(), payload.size());
+                }
+            }
+        }
 
-        if (ctx.transaction_in_checkpoint > ctx.transaction_per_checkpoint) {
-            full_checkpoint(ctx);
+        // every stride-th key, so a chunk of small keys does not outweigh the others
+        size_t stride = (found.size() + keys_per_chunk - 1) / keys_per_chunk;
+        for (size_t k = 0; k < found.size(); k += stride) {
+            keys[i].push_back(std::move(found[k]));
         }
+    });
+
+    std::vector<std::string> samples;
+    for (std::vector<std::string> &chunk: keys) {
+        std::move(chunk.begin(), chunk.end(), std::back_inserter(samples));
     }
+
+    start_shards(ctx, samples);
 }
 
-void restore_page(restore_context_t &ctx, index_page_t &p, index_page_header_t &header,
-                  index_cells_t &cells, uint64_t limit) {
-    start_transaction(ctx);
+template<typename geometry_t>
+void parse_and_restore(restore_context_t &ctx, const database_t<geometry_t> &db) {
+    if (ctx.shard_set && ctx.shard_set->shards.empty()) {
+        sample_shard_splits(ctx, db);
+    }
 
-    ctx.metrics.cells += header.number_of_cell;
+    if (!ctx.reachable_first) {
+        scan_pages(ctx, db, nullptr);
+        return;
+    }
 
-    for (int i = 0; i < header.number_of_cell; ++i) {
-        payload_t payload = p.get_payload(cells, i, limit);
+    page_topology_t topology;
+    build_topology(ctx, db, topology);
 
-        if (!payload.valid || payload.payload_body_size == 0) {
-            continue;
-        }
+    log_t() << "Restoring reachable pages";
+    scan_pages(ctx, db, &topology.reachable);
+
+    if (ctx.skip_orphans) {
+        log_t() << "Skipped " << ctx.metrics.orphan_pages << " orphan pages";
+        return;
+    }
 
-        ctx.metrics.bytes += payload.payload.size();
+    log_t() << "Restoring orphan pages";
+    scan_pages(ctx, db, &topology.orphan);
+}
 
-        // for index type btree, payload is the (fdb encoded) key, no value here
-        check_error("BtreeBeginTrans", sqlite3BtreeInsert(
-                ctx.cursor, payload.payload.data(), payload.payload.size(),
-                nullptr, 0, 0, 0, 0));
+template<uint32_t ReservedPageSize, typename F>
+bool with_page_size(uint32_t page_size, F &&f) {
+    switch (page_size) {
+        case 512: f(page_geometry_t<512, ReservedPageSize>{}); return true;
+        case 1024: f(page_geometry_t<1024, ReservedPageSize>{}); return true;
+        case 2048: f(page_geometry_t<2048, ReservedPageSize>{}); return true;
+        case 4096: f(page_geometry_t<4096, ReservedPageSize>{}); return true;
+        case 8192: f(page_geometry_t<8192, ReservedPageSize>{}); return true;
+        case 16384: f(page_geometry_t<16384, ReservedPageSize>{}); return true;
+        case 32768: f(page_geometry_t<32768, ReservedPageSize>{}); return true;
+        case 65536: f(page_geometry_t<65536, ReservedPageSize>{}); return true;
+        default: return false;
     }
+}
 
-    commit_transaction(ctx, p);
+// Calls f with the page_geometry_t matching the file, returns false if there is none.
+// fdb pages reserve 8 bytes for the checksum, plain sqlite pages reserve nothing.
+template<typename F>
+bool with_page_geometry(uint32_t page_size, uint32_t reserved_page_size, F &&f) {
+    switch (reserved_page_size) {
+        case 0: return with_page_size<0>(page_size, f);
+        case 8: return with_page_size<8>(page_size, f);
+        default: return false;
+    }
 }
 
-void complete_restore(restore_context_t &ctx) {
-    if (ctx.pages_in_transaction > 0) {
-        check_error("BtreeCloseCursor", sqlite3BtreeCloseCursor(ctx.cursor));
-        check_error("BtreeCommit", sqlite3BtreeCommit(ctx.btree));
+/*
+ * The database header on page 1 holds the page size at offset 16 (big-endian, 1 means 65536)
+ * and the number of reserved bytes per page at offset 20. Values given on the command line win,
+ * for files whose page 1 is damaged.
+ */
+void detect_page_geometry(const restore_context_t &ctx, int fd, uint32_t &page_size, uint32_t &reserved_page_size) {
+    unsigned char header[100];
+
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) &&
+        (ctx.page_size == 0 || ctx.reserved_page_size < 0)) {
+        throw restore_error_t("ERROR: file too small to read the page size, use --page-size and --reserved-size");
     }
 
-    full_checkpoint(ctx);
+    if (ctx.page_size != 0) {
+        page_size = ctx.page_size;
+    } else {
+        page_size = (header[16] << 8) | header[17];
+        page_size = page_size == 1 ? 65536 : page_size;
+    }
 
-    check_error("sqlite3_close", sqlite3_close(ctx.db));
-    ctx.db = nullptr;
+    if (ctx.reserved_page_size >= 0) {
+        reserved_page_size = ctx.reserved_page_size;
+    } else {
+        reserved_page_size = header[20];
+    }
+}
+
+// Whether sos can restore pages of this geometry with the options given.
+void check_page_geometry(const restore_context_t &ctx, uint32_t page_size, uint32_t reserved_page_size) {
+    if (ctx.checksum_policy != checksum_policy_t::off && reserved_page_size != sizeof(page_checksum_codec_t::sum_type_t)) {
+        throw restore_error_t("ERROR: checksum verification needs " +
+                              std::to_string(sizeof(page_checksum_codec_t::sum_type_t)) +
+                              " reserved bytes per page, file has " + std::to_string(reserved_page_size));
+    }
+
+    if (!with_page_geometry(page_size, reserved_page_size, [](auto) {})) {
+        throw restore_error_t("ERROR: unsupported page size " + std::to_string(page_size) + " or reserved size " +
+                              std::to_string(reserved_page_size) + ", use --page-size and --reserved-size");
+    }
+}
+
+// The checks open_and_dump() makes before it reads a page, for a batch to reject a job before any starts.
+void check_source(const restore_context_t &ctx, const std::string &file) {
+    struct stat st{};
+
+    if (stat(file.data(), &st) != 0) {
+        throw restore_error_t("ERROR: cannot stat file " + file);
+    }
+
+    int fd = open(file.data(), O_RDONLY);
+
+    if (fd < 0) {
+        throw restore_error_t("ERROR: cannot open file " + file);
+    }
+
+    uint32_t page_size;
+    uint32_t reserved_page_size;
+
+    try {
+        detect_page_geometry(ctx, fd, page_size, reserved_page_size);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+    check_page_geometry(ctx, page_size, reserved_page_size);
 }
 
 /*
- * Index B-Tree Leaf Cell (header 0x0a):
- *    A varint which is the total number of bytes of key payload, including any overflow
- *    The initial portion of the payload that does not spill to overflow pages.
- *    A 4-byte big-endian integer page_t number for the first page_t of the overflow page_t list - omitted if all payload fits on the b-tree page_t.
+ * The streaming reader splits its memory budget between chunk buffers and the page cache. Every parser
+ * holds one chunk buffer and up to 4 parsed chunks per parser wait for the writer.
  */
-void dump_index_page(restore_context_t &ctx, const database_t &db, index_page_t &p) {
-    ctx.metrics.pages += 1;
+std::unique_ptr<page_source_t> open_page_source(restore_context_t &ctx, const std::string &file, int fd,
+                                                int64_t size, uint32_t page_size) {
+    try {
+        if (!ctx.stream_reader) {
+            return std::unique_ptr<page_source_t>(new mmap_page_source_t(fd, size, page_size));
+        }
 
-    index_page_header_t header = p.get_page_header();
-    std::cout << "page: " << p.pno << ", " << header.to_string() << std::endl;
+        int64_t budget = ctx.reader_memory_mb * 1024ll * 1024ll;
+        ctx.pages_per_chunk = std::max<int64_t>(1, budget / 2 / (ctx.threads * 5) / page_size);
+
+        log_t() << "Streaming reader: " << ctx.pages_per_chunk << " pages per chunk, "
+                << budget / 2 / page_size << " cached pages" << (ctx.direct_io ? ", O_DIRECT" : "");
 
-    index_cells_t cells = p.get_cells(header, p);
-    restore_page(ctx, p, header, cells, db.size);
+        return std::unique_ptr<page_source_t>(
+                new stream_page_source_t(file, size, page_size, ctx.direct_io, budget / 2));
+    } catch (const std::exception &e) {
+        throw restore_error_t("ERROR: " + std::string(e.what()) + " " + file);
+    }
 }
 
 void open_and_dump(restore_context_t &ctx, const std::string &file) {
@@ -492,79 +2809,759 @@ void open_and_dump(restore_context_t &ctx, const std::string &file) {
 
     int rc = stat(file.data(), &st);
     if (rc != 0) {
-        std::cout << "ERROR: cannot stat file " << file << std::endl;
+        throw restore_error_t("ERROR: cannot stat file " + file);
+    }
+
+    int fd = open(file.data(), O_RDONLY);
+
+    if (fd < 0) {
+        throw restore_error_t("ERROR: cannot open file " + file);
+    }
+
+    uint32_t page_size;
+    uint32_t reserved_page_size;
+    detect_page_geometry(ctx, fd, page_size, reserved_page_size);
+    log_t() << "page size: " << page_size << ", reserved size: " << reserved_page_size;
+    check_page_geometry(ctx, page_size, reserved_page_size);
+
+    page_checksum_codec_t codec(file);
+    std::unique_ptr<page_source_t> source = open_page_source(ctx, file, fd, st.st_size, page_size);
+
+    with_page_geometry(page_size, reserved_page_size, [&](auto geometry) {
+        using geometry_t = decltype(geometry);
+
+        database_t<geometry_t> db{};
+        db.fd = fd;
+        db.size = st.st_size;
+        db.source = source.get();
+        db.codec = &codec;
+
+        page_extents_t extents;
+        extents.load(fd, st.st_size, geometry_t::page_size);
+        db.extents = &extents;
+
+        if (extents.hole_pages > 0) {
+            log_t() << "Sparse source: " << extents.data.size() << " data extents, " << extents.hole_pages
+                    << " pages in holes";
+        }
+
+        page_map_t map;
+        if (ctx.page_map) {
+            open_page_map(ctx, db, file, st, map);
+            db.map = &map;
+        } else if (db.get_page_size() >= 0x02000000) {
+            // from page 0x02000000 on, the next page number at the start of an overflow page can read as an
+            // index page type, and only the overflow chains of a page map tell them apart
+            log_t() << "WARNING: " << db.get_page_size() << " pages, overflow pages are not told apart from "
+                    << "index pages without --page-map";
+        }
+
+        // loop all pages, page no start from 1
+        parse_and_restore(ctx, db);
+    });
+}
+
+// Returns the value part of "--name=value" if arg is that option, nullptr otherwise.
+const char *option_value(const char *arg, const char *name) {
+    size_t n = strlen(name);
+
+    if (strncmp(arg, name, n) == 0 && arg[n] == '=') {
+        return arg + n + 1;
+    }
+
+    return nullptr;
+}
+
+int parse_int_option(const char *arg, const char *value, int min) {
+    char *end;
+    long result = strtol(value, &end, 10);
+
+    if (end == value || *end != 0 || result < min) {
+        std::cout << "Invalid option " << arg << std::endl;
         std::exit(1);
     }
 
-    database_t db{};
-    db.fd = open(file.data(), O_RDONLY);
+    return (int) result;
+}
 
-    if (db.fd < 0) {
-        std::cout << "ERROR: cannot open file " << file << std::endl;
+void parse_option(restore_context_t &ctx, const char *arg) {
+    const char *value;
+
+    if ((value = option_value(arg, "--threads"))) {
+        ctx.threads = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--page-size"))) {
+        ctx.page_size = parse_int_option(arg, value, 512);
+    } else if ((value = option_value(arg, "--reserved-size"))) {
+        ctx.reserved_page_size = parse_int_option(arg, value, 0);
+    } else if (strcmp(arg, "--reachable-first") == 0) {
+        ctx.reachable_first = true;
+    } else if (strcmp(arg, "--skip-orphans") == 0) {
+        ctx.reachable_first = true;
+        ctx.skip_orphans = true;
+    } else if ((value = option_value(arg, "--reader"))) {
+        if (strcmp(value, "mmap") == 0) {
+            ctx.stream_reader = false;
+        } else if (strcmp(value, "stream") == 0) {
+            ctx.stream_reader = true;
+        } else {
+            std::cout << "Invalid option " << arg << std::endl;
+            std::exit(1);
+        }
+    } else if ((value = option_value(arg, "--reader-memory"))) {
+        ctx.reader_memory_mb = parse_int_option(arg, value, 1);
+    } else if (strcmp(arg, "--direct-io") == 0) {
+        ctx.stream_reader = true;
+        ctx.direct_io = true;
+    } else if ((value = option_value(arg, "--batch"))) {
+        ctx.batch_manifest = value;
+    } else if ((value = option_value(arg, "--jobs"))) {
+        ctx.jobs = parse_int_option(arg, value, 1);
+    } else if (strcmp(arg, "--sort") == 0) {
+        ctx.sort_keys = true;
+    } else if ((value = option_value(arg, "--sort-memory"))) {
+        ctx.sort_memory_mb = parse_int_option(arg, value, 16);
+    } else if ((value = option_value(arg, "--sort-dir"))) {
+        ctx.sort_dir = value;
+    } else if (strcmp(arg, "--skip-duplicates") == 0) {
+        ctx.skip_duplicates = true;
+    } else if ((value = option_value(arg, "--filter-memory"))) {
+        ctx.filter_memory_mb = parse_int_option(arg, value, 1);
+    } else if (strcmp(arg, "--offline") == 0) {
+        ctx.offline = true;
+    } else if ((value = option_value(arg, "--cache-memory"))) {
+        ctx.cache_memory_mb = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--commit-latency"))) {
+        ctx.commit_latency_ms = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--transaction-memory"))) {
+        ctx.transaction_memory_mb = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--checkpoint-wal"))) {
+        ctx.checkpoint_wal_mb = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--checksum-threads"))) {
+        ctx.checksum_threads = parse_int_option(arg, value, 1);
+    } else if ((value = option_value(arg, "--write-buffer"))) {
+        ctx.write_buffer_kb = parse_int_option(arg, value, 4);
+    } else if (strcmp(arg, "--preallocate") == 0) {
+        ctx.preallocate = true;
+    } else if ((value = option_value(arg, "--fsync"))) {
+        if (strcmp(value, "checkpoint") == 0) {
+            ctx.fsync = fsync_policy_t::checkpoint;
+        } else if (strcmp(value, "end") == 0) {
+            ctx.fsync = fsync_policy_t::end;
+        } else if (strcmp(value, "off") == 0) {
+            ctx.fsync = fsync_policy_t::off;
+        } else {
+            std::cout << "Invalid option " << arg << std::endl;
+            std::exit(1);
+        }
+    } else if ((value = option_value(arg, "--shards"))) {
+        ctx.shards = parse_int_option(arg, value, 1);
+    } else if (strcmp(arg, "--bulk-load") == 0) {
+        ctx.bulk_load = true;
+    } else if ((value = option_value(arg, "--fill-factor"))) {
+        ctx.fill_factor = parse_int_option(arg, value, 10);
+
+        if (ctx.fill_factor > 100) {
+            std::cout << "Invalid option " << arg << std::endl;
+            std::exit(1);
+        }
+    } else if (strcmp(arg, "--page-map") == 0) {
+        ctx.page_map = true;
+    } else if (strcmp(arg, "--verbose") == 0) {
+        verbose_log = true;
+    } else if ((value = option_value(arg, "--verify-checksum"))) {
+        if (strcmp(value, "off") == 0) {
+            ctx.checksum_policy = checksum_policy_t::off;
+        } else if (strcmp(value, "skip") == 0) {
+            ctx.checksum_policy = checksum_policy_t::skip;
+        } else if (strcmp(value, "flag") == 0) {
+            ctx.checksum_policy = checksum_policy_t::flag;
+        } else if (strcmp(value, "salvage") == 0) {
+            ctx.checksum_policy = checksum_policy_t::salvage;
+        } else {
+            std::cout << "Invalid option " << arg << std::endl;
+            std::exit(1);
+        }
+    } else {
+        std::cout << "Unknown option " << arg << std::endl;
         std::exit(1);
     }
+}
+
+// One line of a batch manifest: "<source> <template> <start_page_no>".
+struct batch_job_t {
+    std::string source;
+    std::string filename;
+    int start_page = 2;
 
-    db.size = st.st_size;
-    db.base = (const char *) mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, db.fd, 0);
+    // why the job failed, empty while it has not
+    std::string error;
+};
 
-    // loop all pages, page no start from 1
-    for (int i = ctx.start_page; i < db.get_page_size() + 1; ++i) {
-        index_page_t p = db.get_page(i);
+// Checks every source and template up front; jobs that cannot start are failed here and never run.
+void read_manifest(const restore_context_t &ctx, const std::string &manifest, std::vector<batch_job_t> &jobs) {
+    std::ifstream in(manifest);
 
-        if (!p.is_index_leaf() && !p.is_index_interior()) {
-            ctx.metrics.skip_pages += 1;
+    if (!in) {
+        std::cout << "ERROR: cannot open manifest " << manifest << std::endl;
+        std::exit(1);
+    }
+
+    std::string line;
+    for (int line_no = 1; std::getline(in, line); ++line_no) {
+        std::stringstream ss(line);
+        batch_job_t job;
+        std::string rest;
+
+        if (!(ss >> job.source) || job.source[0] == '#') {
             continue;
         }
 
-        dump_index_page(ctx, db, p);
+        if (!(ss >> job.filename >> job.start_page) || (ss >> rest) || job.start_page < 2) {
+            std::cout << "Invalid manifest line " << line_no << ": " << line << std::endl;
+            std::exit(1);
+        }
+
+        struct stat st{};
+
+        try {
+            check_source(ctx, job.source);
+
+            if (stat(job.filename.data(), &st) != 0) {
+                throw restore_error_t("ERROR: cannot stat template " + job.filename);
+            }
+        } catch (restore_error_t &e) {
+            job.error = e.what();
+
+            log_prefix = "[" + job.source + "] ";
+            log_t() << job.error;
+            log_prefix.clear();
+        }
+
+        jobs.push_back(job);
+    }
+}
+
+// The template a bulk load writes into, checked before the scan so a used template fails early.
+struct bulk_template_t {
+    int fd = -1;
+    uint32_t page_size = 0;
+    uint32_t reserved_size = 0;
+    uint32_t page_count = 0;
+    bool auto_vacuum = false;
+
+    bulk_template_t() = default;
+
+    bulk_template_t(const bulk_template_t &) = delete;
+
+    bulk_template_t &operator=(const bulk_template_t &) = delete;
+
+    ~bulk_template_t() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+/*
+ * Opens a template that was never written to: root page 3 an empty leaf, no free pages and no WAL,
+ * which is what FDB creates.
+ */
+void open_bulk_template(restore_context_t &ctx, bulk_template_t &bulk) {
+    bulk.fd = open(ctx.filename.data(), O_RDWR);
+
+    if (bulk.fd < 0) {
+        throw restore_error_t("ERROR: cannot open template " + ctx.filename);
+    }
+
+    struct stat wal{};
+    if (stat((ctx.filename + "-wal").data(), &wal) == 0 && wal.st_size > 0) {
+        throw restore_error_t("ERROR: bulk load needs a template without WAL, " + ctx.filename + "-wal is not empty");
+    }
+
+    struct stat st{};
+    unsigned char header[100];
+
+    if (fstat(bulk.fd, &st) != 0 || pread(bulk.fd, header, sizeof(header), 0) != sizeof(header)) {
+        throw restore_error_t("ERROR: cannot read template " + ctx.filename);
+    }
+
+    bulk.page_size = (header[16] << 8) | header[17];
+    bulk.page_size = bulk.page_size == 1 ? 65536 : bulk.page_size;
+    bulk.reserved_size = header[20];
+    bulk.page_count = ntohl(*(uint32_t *) (header + 28));
+    bulk.auto_vacuum = ntohl(*(uint32_t *) (header + 52)) != 0;
+    uint32_t free_pages = ntohl(*(uint32_t *) (header + 36));
+
+    unsigned char root[8] = {};
+    bool unused = bulk.page_size >= 512 && bulk.page_count >= 3 && free_pages == 0 &&
+                  st.st_size == (off_t) bulk.page_count * bulk.page_size &&
+                  pread(bulk.fd, root, sizeof(root), (off_t) 2 * bulk.page_size) == sizeof(root) &&
+                  root[0] == 0x0a && root[3] == 0 && root[4] == 0;
+
+    if (!unused) {
+        throw restore_error_t("ERROR: bulk load needs an unused template, " + ctx.filename + " has data or free pages");
+    }
+}
+
+// Writes the keys next(key, size) returns, in key order, as the index b-tree of the template, into the pages
+// after its last page and the top page over root page 3.
+template<typename F>
+void write_bulk_template(restore_context_t &ctx, bulk_template_t &bulk, F &&next) {
+    page_checksum_codec_t codec(ctx.filename);
+    codec.pageSize = bulk.page_size;
+    codec.reserveSize = bulk.reserved_size;
+    bool checksums = bulk.reserved_size == sizeof(page_checksum_codec_t::sum_type_t);
+
+    try {
+        btree_builder_t builder(bulk.fd, bulk.page_size, bulk.reserved_size, checksums ? &codec : nullptr,
+                                bulk.auto_vacuum, ctx.fill_factor, 3, bulk.page_count);
+
+        const char *key;
+        uint32_t size;
+
+        while (next(key, size)) {
+            builder.add(key, size);
+        }
+
+        uint32_t pages = builder.finish();
+
+        log_t() << "Bulk loaded " << builder.keys << " keys: " << builder.leaf_pages << " leaf, "
+                << builder.interior_pages << " interior, " << builder.overflow_pages << " overflow pages, depth "
+                << builder.depth() << ", " << pages << " pages in the file";
+
+        ctx.metrics.bulk_pages += builder.leaf_pages + builder.interior_pages + builder.overflow_pages;
+    } catch (restore_error_t &) {
+        throw;
+    } catch (std::exception &e) {
+        throw restore_error_t("ERROR: " + std::string(e.what()) + " " + ctx.filename);
+    }
+}
+
+/*
+ * Inserts the sorted keys with the append bias: every key lands at the right edge of the tree, the pages
+ * it leaves behind are full, and transactions are as large as those of a page order restore.
+ */
+void insert_sorted(restore_context_t &ctx, key_sorter_t &sorter) {
+    uint64_t keys_per_page = std::max<uint64_t>(1, ctx.metrics.cells / std::max<uint32_t>(1, ctx.metrics.pages));
+    uint64_t inserted = 0;
+    const char *key;
+    uint32_t size;
+
+    while (sorter.next(key, size)) {
+        if (inserted % keys_per_page == 0) {
+            start_transaction(ctx);
+        }
+
+        insert_key(ctx, key, size, true);
+        inserted += 1;
+
+        if (inserted % keys_per_page == 0) {
+            commit_transaction(ctx, 0, inserted);
+        }
+    }
+}
+
+// --sort-dir, default the template's directory.
+std::string scratch_dir(const restore_context_t &ctx) {
+    if (!ctx.sort_dir.empty()) {
+        return ctx.sort_dir;
+    }
+
+    size_t slash = ctx.filename.rfind('/');
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : ctx.filename.substr(0, slash);
+}
+
+/*
+ * Collects the keys of the scan in an external sort and writes them in key order, with the insert path
+ * or the bulk loader. The template is opened before the scan, so a template that cannot take the keys
+ * fails early.
+ */
+void sorted_restore(restore_context_t &ctx, const std::string &source) {
+    bulk_template_t bulk;
+
+    if (ctx.bulk_load) {
+        open_bulk_template(ctx, bulk);
+    } else {
+        begin_restore(ctx);
+    }
+
+    try {
+        ctx.sorter = std::make_shared<key_sorter_t>(scratch_dir(ctx), (size_t) ctx.sort_memory_mb << 20,
+                                                    ctx.skip_duplicates);
+        open_and_dump(ctx, source);
+
+        key_sorter_t &sorter = *ctx.sorter;
+        sorter.finish();
+
+        if (sorter.runs.empty()) {
+            log_t() << "Sorted keys in memory";
+        } else {
+            log_t() << "Sorted keys in " << sorter.runs.size() << " runs, " << sorter.run_file_bytes()
+                    << " bytes spilled for " << sorter.run_key_bytes() << " key bytes";
+        }
+
+        if (ctx.bulk_load) {
+            write_bulk_template(ctx, bulk, [&sorter](const char *&key, uint32_t &size) {
+                return sorter.next(key, size);
+            });
+        } else {
+            insert_sorted(ctx, sorter);
+            complete_restore(ctx);
+        }
+
+        ctx.metrics.sorted_keys += sorter.keys;
+        ctx.metrics.sort_duplicates += sorter.duplicates;
+        ctx.metrics.duplicates_skipped += sorter.identical;
+        ctx.metrics.sort_malformed += sorter.malformed();
+        ctx.metrics.sort_runs += sorter.runs.size();
+        ctx.metrics.sort_run_key_bytes += sorter.run_key_bytes();
+        ctx.metrics.sort_run_file_bytes += sorter.run_file_bytes();
+    } catch (restore_error_t &) {
+        throw;
+    } catch (std::exception &e) {
+        throw restore_error_t("ERROR: " + std::string(e.what()));
+    }
+
+    ctx.sorter.reset();
+}
+
+/*
+ * Reads the keys of the shard trees, one tree after the other, each from its first to its last cell. The
+ * trees hold consecutive key ranges, so this is key order.
+ */
+struct shard_reader_t {
+    shard_set_t &set;
+    size_t current = 0;
+    bool open = false;
+    std::vector<char> key;
+
+    explicit shard_reader_t(shard_set_t &set) : set(set) {}
+
+    bool next(const char *&data, uint32_t &size) {
+        while (current < set.shards.size()) {
+            restore_context_t &ctx = set.shards[current]->ctx;
+            int eof = 0;
+
+            if (!open) {
+                // only reads, and closes without complete_restore()
+                ctx.checkpoint_wal_mb = 0;
+                begin_restore(ctx);
+                check_error("BtreeBeginTrans", sqlite3BtreeBeginTrans(ctx.btree, false));
+                sqlite3BtreeCursorZero(ctx.cursor);
+                check_error("BtreeCursor", sqlite3BtreeCursor(ctx.btree, 3, false, &ctx.keyInfo, ctx.cursor));
+                check_error("BtreeFirst", sqlite3BtreeFirst(ctx.cursor, &eof));
+                open = true;
+            } else {
+                check_error("BtreeNext", sqlite3BtreeNext(ctx.cursor, &eof));
+            }
+
+            if (!eof && !sqlite3BtreeEof(ctx.cursor)) {
+                i64 n = 0;
+                check_error("BtreeKeySize", sqlite3BtreeKeySize(ctx.cursor, &n));
+                key.resize(n);
+                check_error("BtreeKey", sqlite3BtreeKey(ctx.cursor, 0, n, key.data()));
+
+                data = key.data();
+                size = n;
+                return true;
+            }
+
+            check_error("BtreeCloseCursor", sqlite3BtreeCloseCursor(ctx.cursor));
+            check_error("BtreeCommit", sqlite3BtreeCommit(ctx.btree));
+            check_error("sqlite3_close", sqlite3_close(ctx.db));
+            ctx.db = nullptr;
+            free(ctx.cursor);
+            ctx.cursor = nullptr;
+
+            open = false;
+            current += 1;
+        }
+
+        return false;
+    }
+};
+
+/*
+ * Routes the keys of the scan by key range to shard writers, then bulk loads the shard trees one after the
+ * other into the template. The scan thread only parses and routes; the inserts, the expensive part, run
+ * on as many threads as there are shards.
+ */
+void sharded_restore(restore_context_t &ctx, const std::string &source) {
+    bulk_template_t bulk;
+    open_bulk_template(ctx, bulk);
+
+    ctx.shard_set = std::make_shared<shard_set_t>();
+    shard_set_t &set = *ctx.shard_set;
+    set.template_fd = bulk.fd;
+    set.template_size = (off_t) bulk.page_count * bulk.page_size;
+    set.dir = scratch_dir(ctx);
+
+    open_and_dump(ctx, source);
+    finish_shards(ctx);
+
+    log_t() << "Shard trees complete, " << ctx.metrics.largest_shard_keys << " keys in the largest";
+
+    shard_reader_t reader(set);
+    write_bulk_template(ctx, bulk, [&reader](const char *&key, uint32_t &size) {
+        return reader.next(key, size);
+    });
+
+    ctx.shard_set.reset();
+}
+
+void restore_file(restore_context_t &ctx, const std::string &source) {
+    // a template restored into through the insert path ends up about as large as the source
+    struct stat st{};
+    if (ctx.preallocate && stat(source.data(), &st) == 0) {
+        ctx.preallocate_bytes = st.st_size;
+    }
+
+    try {
+        if (ctx.shards > 0) {
+            sharded_restore(ctx, source);
+            return;
+        }
+
+        if (ctx.sort_keys || ctx.bulk_load) {
+            sorted_restore(ctx, source);
+            return;
+        }
+
+        if (ctx.skip_duplicates) {
+            ctx.filter = std::make_shared<duplicate_filter_t>((size_t) ctx.filter_memory_mb << 20);
+        }
+
+        begin_restore(ctx);
+        open_and_dump(ctx, source);
+        complete_restore(ctx);
+    } catch (...) {
+        // a batch goes on with the next job: close the template, the shard trees and their connections
+        ctx.shard_set.reset();
+        abort_restore(ctx);
+        throw;
+    }
+
+    ctx.filter.reset();
+}
+
+/*
+ * Restores every job of the manifest, at most ctx.jobs at a time. The parser threads and the stream
+ * reader memory given on the command line are a budget for the whole batch and split between the
+ * jobs running at once; every job still has its own connection and writer thread. A job that fails
+ * does not stop the others. Returns the number of failed jobs.
+ */
+size_t run_batch(const restore_context_t &prototype, const std::string &manifest) {
+    std::vector<batch_job_t> jobs;
+    read_manifest(prototype, manifest, jobs);
+
+    int concurrent = std::max(1, std::min<int>(prototype.jobs, jobs.size()));
+
+    restore_context_t shared = prototype;
+    shared.threads = std::max(1, prototype.threads / concurrent);
+    shared.reader_memory_mb = std::max(1, prototype.reader_memory_mb / concurrent);
+    shared.sort_memory_mb = std::max(16, prototype.sort_memory_mb / concurrent);
+    shared.filter_memory_mb = std::max(1, prototype.filter_memory_mb / concurrent);
+    shared.cache_memory_mb = std::max(1, prototype.cache_memory_mb / concurrent);
+    shared.transaction_memory_mb = std::max(1, prototype.transaction_memory_mb / concurrent);
+    shared.checksum_threads = std::max(1, prototype.checksum_threads / concurrent);
+    shared.shards = prototype.shards > 0 ? std::max(1, prototype.shards / concurrent) : 0;
+
+    log_t() << "Batch: " << jobs.size() << " jobs, " << concurrent << " at a time, " << shared.threads
+            << " parser threads each";
+
+    std::atomic<size_t> next{0};
+    std::mutex metrics_mutex;
+    metrics_t total;
+
+    auto worker = [&] {
+        for (size_t i = next++; i < jobs.size(); i = next++) {
+            if (!jobs[i].error.empty()) {
+                continue;
+            }
+
+            restore_context_t ctx = shared;
+            ctx.filename = jobs[i].filename;
+            ctx.start_page = jobs[i].start_page;
+
+            log_prefix = "[" + jobs[i].source + "] ";
+            log_t() << "Restoring into " << ctx.filename << " from page " << ctx.start_page;
+
+            try {
+                restore_file(ctx, jobs[i].source);
+            } catch (std::exception &e) {
+                jobs[i].error = dynamic_cast<restore_error_t *>(&e) ? e.what() : "ERROR: " + std::string(e.what());
+                log_t() << jobs[i].error;
+                continue;
+            }
+
+            std::string metrics = ctx.metrics.to_string();
+            log_t() << metrics.substr(0, metrics.size() - 1);
+
+            std::lock_guard<std::mutex> lock(metrics_mutex);
+            total.add(ctx.metrics);
+        }
+        log_prefix.clear();
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < concurrent; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    for (std::thread &w: workers) {
+        w.join();
+    }
+
+    size_t failed = 0;
+    for (batch_job_t &job: jobs) {
+        failed += !job.error.empty();
+    }
+
+    std::cout << "jobs: " << jobs.size() << std::endl;
+
+    if (failed > 0) {
+        std::cout << "failed jobs: " << failed << std::endl;
+
+        for (batch_job_t &job: jobs) {
+            if (!job.error.empty()) {
+                std::cout << "  [" << job.source << "] " << job.error << std::endl;
+            }
+        }
     }
+
+    std::cout << total.to_string();
+    return failed;
 }
 
 int main(int argc, const char **argv) {
-    if (argc < 4) {
+    restore_context_t ctx{};
+    std::vector<const char *> args;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            parse_option(ctx, argv[i]);
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    // in batch mode the manifest names sources, templates and start pages
+    size_t tuning_args = ctx.batch_manifest.empty() ? 3 : 0;
+
+    if (args.size() < tuning_args) {
         std::cout << "Version: 0.2.2" << std::endl
                   << "Usage:" << std::endl
-                  << "  bin/sos <start_page_no> [pages_per_transaction] [transaction_per_checkpoint]" << std::endl
+                  << "  bin/sos [options] <source> <template> <start_page_no> [pages_per_transaction] [transaction_per_checkpoint]" << std::endl
+                  << "  bin/sos [options] --batch=<manifest> [pages_per_transaction] [transaction_per_checkpoint]" << std::endl
                   << "    " << "start_page_no: Start page number，must >=2" << std::endl
+                  << "    " << "manifest: one \"<source> <template> <start_page_no>\" per line, # starts a comment"
+                  << std::endl
                   << "    " << "pages_per_transaction: pages per transaction interval, default 1024" << std::endl
                   << "    " << "transaction_per_checkpoint: transaction per checkpoint interval, default 10"
-                  << std::endl;
+                  << std::endl
+                  << "Options:" << std::endl
+                  << "    " << "--threads=N: parser threads, pages are inserted by one writer thread, default 1"
+                  << std::endl
+                  << "    " << "--verify-checksum=off|skip|flag|salvage: policy for source pages whose checksum"
+                  << " does not match, default off" << std::endl
+                  << "    " << "--page-size=N, --reserved-size=N: source page geometry, default read from page 1"
+                  << std::endl
+                  << "    " << "--reachable-first: restore pages reachable from b-tree roots before orphan pages"
+                  << std::endl
+                  << "    " << "--skip-orphans: like --reachable-first, but never restore orphan and freed pages"
+                  << std::endl
+                  << "    " << "--reader=mmap|stream: map the whole source, or read it in chunks with pread, default mmap"
+                  << std::endl
+                  << "    " << "--reader-memory=MB: memory cap of the stream reader, default 256" << std::endl
+                  << "    " << "--direct-io: stream the source with O_DIRECT, bypassing the page cache" << std::endl
+                  << "    " << "--page-map: keep page types in <source>.pagemap, later runs only read index pages"
+                  << std::endl
+                  << "    " << "--verbose: log the header of every page decoded and every cell with overflow content"
+                  << std::endl
+                  << "    " << "--jobs=N: batch jobs restored at a time, sharing --threads and --reader-memory, default 1"
+                  << std::endl
+                  << "    " << "--sort: insert the keys in key order, sorted with --sort-memory and spilled to --sort-dir"
+                  << std::endl
+                  << "    " << "--sort-memory=MB: memory for sorting keys before runs are spilled, default 1024" << std::endl
+                  << "    " << "--sort-dir=DIR: scratch directory for spilled runs, default the template's directory"
+                  << std::endl
+                  << "    " << "--skip-duplicates: do not restore a key twice, copies in freed and interior pages"
+                  << " are skipped" << std::endl
+                  << "    " << "--filter-memory=MB: memory of the filter that rules out duplicates, default 64"
+                  << std::endl
+                  << "    " << "--bulk-load: sort the keys and write the index b-tree bottom-up into an unused template"
+                  << std::endl
+                  << "    " << "--fill-factor=N: percent of every bulk loaded page filled with keys, 10 to 100, default 100"
+                  << std::endl
+                  << "    " << "--shards=N: insert N key ranges on N threads into temporary b-trees in --sort-dir,"
+                  << " then bulk load them into an unused template" << std::endl
+                  << "    " << "--offline: the template is not in use, write it without journal and checkpoints,"
+                  << " sync once at the end" << std::endl
+                  << "    " << "--cache-memory=MB: page cache of an --offline restore, default 1024" << std::endl
+                  << "    " << "--commit-latency=MS: size transactions by key bytes toward commits of MS milliseconds,"
+                  << " instead of pages_per_transaction" << std::endl
+                  << "    " << "--transaction-memory=MB: dirty template pages a sized transaction may hold, default 256"
+                  << std::endl
+                  << "    " << "--checkpoint-wal=MB: checkpoint on a background thread once the WAL holds MB,"
+                  << " instead of every transaction_per_checkpoint transactions" << std::endl
+                  << "    " << "--checksum-threads=N: threads hashing the template pages of a write-out, default 1"
+                  << std::endl
+                  << "    " << "--write-buffer=KB: combine adjacent template writes into writes of up to KB"
+                  << std::endl
+                  << "    " << "--preallocate: allocate the template ahead, as large as the source" << std::endl
+                  << "    " << "--fsync=checkpoint|end|off: sync the template when sqlite asks, once at the end,"
+                  << " or never, default checkpoint" << std::endl;
 
         std::exit(1);
     }
 
-    restore_context_t ctx{argv[2]};
-
     char *end;
-    ctx.start_page = (int) strtol(argv[3], &end, 10);
 
-    if (end == argv[3] || *end != 0 || ctx.start_page < 2) {
-        std::cout << "Invalid start page " << argv[3] << std::endl;
-        std::exit(1);
+    if (tuning_args == 3) {
+        ctx.filename = args[1];
+        ctx.start_page = (int) strtol(args[2], &end, 10);
+
+        if (end == args[2] || *end != 0 || ctx.start_page < 2) {
+            std::cout << "Invalid start page " << args[2] << std::endl;
+            std::exit(1);
+        }
     }
 
-    if (argc == 5) {
-        ctx.pages_per_transaction = (int) strtol(argv[4], &end, 10);
+    if (args.size() >= tuning_args + 1) {
+        ctx.pages_per_transaction = (int) strtol(args[tuning_args], &end, 10);
 
-        if (end == argv[4] || *end != 0 || ctx.pages_per_transaction < 1) {
-            std::cout << "Invalid pages per checkpoint " << argv[4] << std::endl;
+        if (end == args[tuning_args] || *end != 0 || ctx.pages_per_transaction < 1) {
+            std::cout << "Invalid pages per checkpoint " << args[tuning_args] << std::endl;
             std::exit(1);
         }
     }
 
-    if (argc == 6) {
-        ctx.transaction_per_checkpoint = (int) strtol(argv[5], &end, 10);
+    if (args.size() >= tuning_args + 2) {
+        ctx.transaction_per_checkpoint = (int) strtol(args[tuning_args + 1], &end, 10);
 
-        if (end == argv[5] || *end != 0 || ctx.transaction_per_checkpoint < 1) {
-            std::cout << "Invalid transaction per transaction " << argv[5] << std::endl;
+        if (end == args[tuning_args + 1] || *end != 0 || ctx.transaction_per_checkpoint < 1) {
+            std::cout << "Invalid transaction per transaction " << args[tuning_args + 1] << std::endl;
             std::exit(1);
         }
     }
 
+    if (ctx.shards > 0 && ctx.sort_keys) {
+        std::cout << "ERROR: --shards and --sort cannot be combined" << std::endl;
+        std::exit(1);
+    }
 
-    begin_restore(ctx);
-    open_and_dump(ctx, argv[1]);
-    complete_restore(ctx);
+    sqlite3_initialize();
+
+    if (!ctx.batch_manifest.empty()) {
+        return run_batch(ctx, ctx.batch_manifest) == 0 ? 0 : 1;
+    }
+
+    try {
+        restore_file(ctx, args[0]);
+    } catch (restore_error_t &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
 
     std::cout << ctx.metrics.to_string();
 }
@@ -4715,6 +4715,130 @@ moveto_finish:
   return rc;
 }
 
+/*
+** Compare the key in cell iCell of index page pPage with pIdxKey, the
+** way sqlite3BtreeMovetoUnpacked() does. Only for cells whose payload is
+** all on the page: return 0 and write the comparison result to *pC, or
+** 1 if the payload overflows.
+*/
+static int compareLocalIndexCell(
+  MemPage *pPage,          /* Index page holding the cell */
+  int iCell,               /* Cell to compare with */
+  UnpackedRecord *pIdxKey, /* Unpacked key */
+  int *pC                  /* Write the comparison result here */
+){
+  CellInfo info;
+  btreeParseCellPtr(pPage, findCell(pPage, iCell), &info);
+  if( info.nLocal!=info.nKey ){
+    return 1;
+  }
+  *pC = sqlite3VdbeRecordCompare(info.nLocal, info.pCell + info.nHeader,
+                                 pIdxKey, 0, NULL);
+  return 0;
+}
+
+/*
+** Return true if the leaf an index cursor points to is where pIdxKey
+** belongs: the key lies strictly between the separator keys of the
+** cursor's ancestors that bound the leaf. Separators whose payload
+** overflows are not compared, the leaf is then assumed not to hold the
+** key.
+*/
+static int leafHoldsKey(BtCursor *pCur, UnpackedRecord *pIdxKey){
+  MemPage *pPage = pCur->apPage[pCur->iPage];
+  int haveLower = 0;
+  int haveUpper = 0;
+  int i;
+  if( !pPage->leaf || pPage->intKey || pPage->nCell==0 ){
+    return 0;
+  }
+  for(i=pCur->iPage-1; i>=0 && !(haveLower && haveUpper); i--){
+    MemPage *pParent = pCur->apPage[i];
+    int idx = pCur->aiIdx[i];
+    int c;
+    if( !haveUpper && idx<pParent->nCell ){
+      if( compareLocalIndexCell(pParent, idx, pIdxKey, &c) || c<=0 ){
+        return 0;
+      }
+      haveUpper = 1;
+    }
+    if( !haveLower && idx>0 ){
+      if( compareLocalIndexCell(pParent, idx-1, pIdxKey, &c) || c>=0 ){
+        return 0;
+      }
+      haveLower = 1;
+    }
+  }
+  return 1;
+}
+
+/*
+** Move an index cursor to where the packed key pKey would be inserted,
+** with the same results as sqlite3BtreeMovetoUnpacked(). If the cursor
+** still points into the leaf whose key range holds the key, as it does
+** after an insert that did not rebalance the tree, only that leaf is
+** searched and *pSkipped is set; otherwise the cursor descends from the
+** root. Inserting keys that are close to each other, such as the cells of
+** one source page, then skips most descents.
+*/
+SQLITE_PRIVATE int sqlite3BtreeMovetoLeaf(
+  BtCursor *pCur,          /* The index cursor to be moved */
+  const void *pKey,        /* Packed index key */
+  i64 nKey,                /* Size of pKey */
+  int biasRight,           /* If true, bias a full search to the high end */
+  int *pRes,               /* Write the search result here */
+  int *pSkipped            /* Set if the root-to-leaf descent was skipped */
+){
+  int rc = SQLITE_OK;
+  UnpackedRecord *pIdxKey;
+  char aSpace[150];
+
+  assert( cursorHoldsMutex(pCur) );
+  assert( pCur->pKeyInfo!=0 );
+  *pSkipped = 0;
+
+  pIdxKey = sqlite3VdbeRecordUnpack(pCur->pKeyInfo, (int)nKey, pKey,
+                                    aSpace, sizeof(aSpace));
+  if( pIdxKey==0 ) return SQLITE_NOMEM;
+
+  if( pCur->eState==CURSOR_VALID && leafHoldsKey(pCur, pIdxKey) ){
+    MemPage *pPage = pCur->apPage[pCur->iPage];
+    int lwr = 0;
+    int upr = pPage->nCell-1;
+    int c = 0;
+    int overflow = 0;
+    pCur->aiIdx[pCur->iPage] = (u16)(biasRight ? upr : (lwr+upr)/2);
+    for(;;){
+      int idx = pCur->aiIdx[pCur->iPage];
+      if( compareLocalIndexCell(pPage, idx, pIdxKey, &c) ){
+        overflow = 1;
+        break;
+      }
+      if( c==0 ) break;
+      if( c<0 ){
+        lwr = idx+1;
+      }else{
+        upr = idx-1;
+      }
+      if( lwr>upr ) break;
+      pCur->aiIdx[pCur->iPage] = (u16)((lwr+upr)/2);
+    }
+    pCur->info.nSize = 0;
+    pCur->validNKey = 0;
+    if( !overflow ){
+      *pRes = c;
+      *pSkipped = 1;
+      goto moveto_leaf_finish;
+    }
+  }
+
+  rc = sqlite3BtreeMovetoUnpacked(pCur, pIdxKey, nKey, biasRight, pRes);
+
+moveto_leaf_finish:
+  sqlite3VdbeDeleteUnpackedRecord(pIdxKey);
+  return rc;
+}
+
 
 /*
 ** Return TRUE if the cursor is not pointing at an entry of the table.
@@ -7906,6 +8030,24 @@ SQLITE_PRIVATE Pager *sqlite3BtreePager(Btree *p){
   return p->pBt->pPager;
 }
 
+/*
+** Return the number of pages the open write transaction holds dirty in
+** the page cache, so a caller can bound the memory a transaction pins.
+*/
+SQLITE_PRIVATE int sqlite3BtreeDirtyPages(Btree *p){
+  return sqlite3PagerDirtyCount(p->pBt->pPager);
+}
+
+/*
+** Return the number of frames in the WAL after the last commit through
+** this handle, or 0 if nothing was committed since the previous call.
+** This is the count a wal_hook gets, for callers that commit through
+** the b-tree layer, where no hook is invoked.
+*/
+SQLITE_PRIVATE int sqlite3BtreeWalFrames(Btree *p){
+  return sqlite3PagerWalCallback(p->pBt->pPager);
+}
+
 #ifndef SQLITE_OMIT_INTEGRITY_CHECK
 /*
 ** Append a message to the error message string.
@@ -153,6 +153,14 @@ int sqlite3BtreeMovetoUnpacked(
   int bias,
   int *pRes
 );
+int sqlite3BtreeMovetoLeaf(
+  BtCursor*,
+  const void *pKey,
+  i64 nKey,
+  int bias,
+  int *pRes,
+  int *pSkipped
+);
 int sqlite3BtreeCursorHasMoved(BtCursor*, int*);
 int sqlite3BtreeDelete(BtCursor*);
 int sqlite3BtreeDeleteRange(BtCursor*, BtCursor*, int* stackBegin, int* stackEnd);
@@ -176,6 +184,8 @@ sqlite3_int64 sqlite3BtreeGetCachedRowid(BtCursor*);
 
 char *sqlite3BtreeIntegrityCheck(Btree*, int *aRoot, int nRoot, int, int*, int);
 struct Pager *sqlite3BtreePager(Btree*);
+int sqlite3BtreeDirtyPages(Btree*);
+int sqlite3BtreeWalFrames(Btree*);
 
 int sqlite3BtreePutData(BtCursor*, u32 offset, u32 amt, void*);
 void sqlite3BtreeCacheOverflow(BtCursor *);
@@ -1,7 +1,7 @@
 #ifndef NDEBUG
     #define SQLITE_DEBUG 1
 #endif
-#define SQLITE_THREADSAFE 0
+#define SQLITE_THREADSAFE 2
 #define ENABLE_SCRATCHALLOC_CHECK 0
 #define SQLITE_OMIT_SHARED_CACHE 1
 #define SQLITE_FILE_HEADER "FoundationDB100"
@@ -1966,6 +1966,7 @@ SQLITE_PRIVATE void *sqlite3PagerGetExtra(DbPage *);
 
 /* Functions used to manage pager transactions and savepoints. */
 SQLITE_PRIVATE void sqlite3PagerPagecount(Pager*, int*);
+SQLITE_PRIVATE int sqlite3PagerDirtyCount(Pager*);
 SQLITE_PRIVATE int sqlite3PagerBegin(Pager*, int exFlag, int);
 SQLITE_PRIVATE int sqlite3PagerCommitPhaseOne(Pager*,const char *zMaster, int);
 SQLITE_PRIVATE int sqlite3PagerExclusiveLock(Pager*);
@@ -2148,6 +2149,9 @@ SQLITE_PRIVATE int sqlite3PcachePageRefcount(PgHdr*);
 /* Return the total number of pages stored in the cache */
 SQLITE_PRIVATE int sqlite3PcachePagecount(PCache*);
 
+/* Return the number of dirty pages in the cache */
+SQLITE_PRIVATE int sqlite3PcacheDirtyCount(PCache*);
+
 #if defined(SQLITE_CHECK_PAGES) || defined(SQLITE_DEBUG)
 /* Iterate through all dirty pages currently stored in the cache. This
 ** interface is only available if SQLITE_CHECK_PAGES is defined when the 
@@ -20344,6 +20348,10 @@ static int unixFileControl(sqlite3_file *id, int op, void *pArg){
     case SQLITE_FCNTL_SIZE_HINT: {
       return fcntlSizeHint((unixFile *)id, *(i64 *)pArg);
     }
+    case SQLITE_FCNTL_UNIX_HANDLE: {
+      *(int*)pArg = ((unixFile*)id)->h;
+      return SQLITE_OK;
+    }
 #ifndef NDEBUG
     /* The pager calls this method to signal that it has done
     ** a rollback and that the database is therefore unchanged and
@@ -27035,6 +27043,7 @@ bitvec_end:
 struct PCache {
   PgHdr *pDirty, *pDirtyTail;         /* List of dirty pages in LRU order */
   PgHdr *pSynced;                     /* Last synced page in dirty page list */
+  int nDirty;                         /* Number of pages on the dirty list */
   int nRef;                           /* Number of referenced pages */
   int nMax;                           /* Configured cache size */
   int szPage;                         /* Size of every page in this cache */
@@ -27109,6 +27118,7 @@ static void pcacheRemoveFromDirtyList(PgHdr *pPage){
   }
   pPage->pDirtyNext = 0;
   pPage->pDirtyPrev = 0;
+  p->nDirty--;
 
   expensive_assert( pcacheCheckSynced(p) );
 }
@@ -27134,6 +27144,7 @@ static void pcacheAddToDirtyList(PgHdr *pPage){
   if( !p->pSynced && 0==(pPage->flags&PGHDR_NEED_SYNC) ){
     p->pSynced = pPage;
   }
+  p->nDirty++;
   expensive_assert( pcacheCheckSynced(p) );
 }
 
@@ -27564,6 +27575,14 @@ SQLITE_PRIVATE int sqlite3PcachePageRefcount(PgHdr *p){
   return p->nRef;
 }
 
+/*
+** Return the number of dirty pages in the cache, written out by the
+** next commit or cache spill.
+*/
+SQLITE_PRIVATE int sqlite3PcacheDirtyCount(PCache *pCache){
+  return pCache->nDirty;
+}
+
 /* 
 ** Return the total number of pages in the cache.
 */
@@ -29803,6 +29822,8 @@ struct Pager {
   void (*xCodecSizeChng)(void*,int,int); /* Notify of page size changes */
   void (*xCodecFree)(void*);             /* Destructor for the codec */
   void *pCodec;               /* First argument to xCodec... methods */
+  int (*xCodecBatch)(void*,void**,Pgno*,int); /* Encode many pages at once */
+  int codecBatched;           /* Pages being written are encoded already */
 #endif
   char *pTmpSpace;            /* Pager.pageSize bytes of space for tmp use */
   PCache *pPCache;            /* Pointer to page cache object */
@@ -32027,6 +32048,50 @@ static void pager_write_changecounter(PgHdr *pPg){
   put32bits(((char*)pPg->pData)+96, SQLITE_VERSION_NUMBER);
 }
 
+#ifdef SQLITE_HAS_CODEC
+/*
+** Encode, in place and with a single call to the batch codec, every page
+** of pList that is about to be written with op 6. Return non-zero if the
+** pages were encoded, in which case the write-out uses the page data as
+** it is. Without a batch codec, or if it fails, each page is encoded as
+** it is written, as before.
+*/
+static int pagerCodecBatch(Pager *pPager, PgHdr *pList, int bWal){
+  PgHdr *p;
+  void **apData;
+  Pgno *aPgno;
+  int n = 0;
+  int rc;
+
+  if( pPager->xCodec==0 || pPager->xCodecBatch==0 ) return 0;
+  for(p=pList; p; p=p->pDirty){
+    if( bWal || (p->pgno<=pPager->dbSize && 0==(p->flags&PGHDR_DONT_WRITE)) ) n++;
+  }
+  if( n==0 ) return 0;
+
+  apData = (void**)sqlite3Malloc(n*(sizeof(void*)+sizeof(Pgno)));
+  if( apData==0 ) return 0;
+  aPgno = (Pgno*)&apData[n];
+
+  n = 0;
+  for(p=pList; p; p=p->pDirty){
+    if( bWal || (p->pgno<=pPager->dbSize && 0==(p->flags&PGHDR_DONT_WRITE)) ){
+      /* page 1 gets its change counter before it is encoded, as below */
+      if( p->pgno==1 ) pager_write_changecounter(p);
+      apData[n] = p->pData;
+      aPgno[n] = p->pgno;
+      n++;
+    }
+  }
+
+  rc = pPager->xCodecBatch(pPager->pCodec, apData, aPgno, n);
+  sqlite3_free(apData);
+  return rc;
+}
+#else
+# define pagerCodecBatch(P,L,W) 0
+#endif
+
 #ifndef SQLITE_OMIT_WAL
 /*
 ** This function is invoked once for each page that has already been 
@@ -32127,9 +32192,15 @@ static int pagerWalFrames(
 #endif
 
   if( pList->pgno==1 ) pager_write_changecounter(pList);
+#ifdef SQLITE_HAS_CODEC
+  pPager->codecBatched = pagerCodecBatch(pPager, pList, 1);
+#endif
   rc = sqlite3WalFrames(pPager->pWal, 
       pPager->pageSize, pList, nTruncate, isCommit, syncFlags
   );
+#ifdef SQLITE_HAS_CODEC
+  pPager->codecBatched = 0;
+#endif
   if( rc==SQLITE_OK && pPager->pBackup ){
     PgHdr *p;
     for(p=pList; p; p=p->pDirty){
@@ -32755,6 +32826,14 @@ SQLITE_PRIVATE void sqlite3PagerPagecount(Pager *pPager, int *pnPage){
   *pnPage = (int)pPager->dbSize;
 }
 
+/*
+** Return the number of pages of the open write transaction held dirty
+** in the page cache.
+*/
+SQLITE_PRIVATE int sqlite3PagerDirtyCount(Pager *pPager){
+  return sqlite3PcacheDirtyCount(pPager->pPCache);
+}
+
 
 /*
 ** Try to obtain a lock of type locktype on the database file. If
@@ -33123,6 +33202,7 @@ static int syncJournal(Pager *pPager, int newHdr){
 */
 static int pager_write_pagelist(Pager *pPager, PgHdr *pList){
   int rc = SQLITE_OK;                  /* Return code */
+  int batched;                         /* True if the pages are encoded already */
 
   /* This function is only called for rollback pagers in WRITER_DBMOD state. */
   assert( !pagerUseWal(pPager) );
@@ -33148,6 +33228,8 @@ static int pager_write_pagelist(Pager *pPager, PgHdr *pList){
     pPager->dbHintSize = pPager->dbSize;
   }
 
+  batched = pagerCodecBatch(pPager, pList, 0);
+
   while( rc==SQLITE_OK && pList ){
     Pgno pgno = pList->pgno;
 
@@ -33166,8 +33248,12 @@ static int pager_write_pagelist(Pager *pPager, PgHdr *pList){
       assert( (pList->flags&PGHDR_NEED_SYNC)==0 );
       if( pList->pgno==1 ) pager_write_changecounter(pList);
 
-      /* Encode the database */
-      CODEC2(pPager, pList->pData, pgno, 6, return SQLITE_NOMEM, pData);
+      /* Encode the database, unless the batch codec did already */
+      if( batched ){
+        pData = (char*)pList->pData;
+      }else{
+        CODEC2(pPager, pList->pData, pgno, 6, return SQLITE_NOMEM, pData);
+      }
 
       /* Write out the page data. */
       rc = sqlite3OsWrite(pPager->fd, pData, pPager->pageSize, offset);
@@ -35409,6 +35495,14 @@ SQLITE_PRIVATE void sqlite3BtreePagerSetCodec(
   return sqlite3PagerSetCodec(sqlite3BtreePager(bt), xCodec, xCodecSizeChng, xCodecFree, pCodec);
 }
 
+/* Set a codec that encodes many pages for writing at once */
+SQLITE_PRIVATE void sqlite3BtreePagerSetCodecBatch(
+  Btree *bt,
+  int (*xCodecBatch)(void*,void**,Pgno*,int)
+){
+  sqlite3BtreePager(bt)->xCodecBatch = xCodecBatch;
+}
+
 SQLITE_PRIVATE void *sqlite3PagerGetCodec(Pager *pPager){
   return pPager->pCodec;
 }
@@ -35947,6 +36041,7 @@ SQLITE_PRIVATE int sqlite3PagerCloseWal(Pager *pPager){
 */
 SQLITE_PRIVATE void *sqlite3PagerCodec(PgHdr *pPg){
   void *aData = 0;
+  if( pPg->pPager->codecBatched ) return pPg->pData;
   CODEC2(pPg->pPager, pPg->pData, pPg->pgno, 6, return 0, aData);
   return aData;
 }
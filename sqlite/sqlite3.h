@@ -739,6 +739,10 @@ struct sqlite3_io_methods {
 ** Applications should not call [sqlite3_file_control()] with this
 ** opcode as doing so may disrupt the operation of the specilized VFSes
 ** that do require it.  
+**
+** The [SQLITE_FCNTL_UNIX_HANDLE] opcode writes the file descriptor of a
+** file of the unix VFS into the integer pArg points to, for a VFS layered
+** over it that allocates file space itself.
 */
 #define SQLITE_FCNTL_LOCKSTATE        1
 #define SQLITE_GET_LOCKPROXYFILE      2
@@ -748,6 +752,7 @@ struct sqlite3_io_methods {
 #define SQLITE_FCNTL_CHUNK_SIZE       6
 #define SQLITE_FCNTL_FILE_POINTER     7
 #define SQLITE_FCNTL_SYNC_OMITTED     8
+#define SQLITE_FCNTL_UNIX_HANDLE      9
 
 
 /*
@@ -4032,6 +4037,10 @@ SQLITE_API void sqlite3BtreePagerSetCodec(
   void (*xCodecFree)(void*),
   void *pCodec
 );
+SQLITE_API void sqlite3BtreePagerSetCodecBatch(
+  Btree *bt,
+  int (*xCodecBatch)(void*,void**,Pgno*,int)
+);
 
 #if !defined(SQLITE_HAS_CODEC_NO_ENCRYPTION)
 /*
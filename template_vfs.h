@@ -0,0 +1,457 @@
+#ifndef __SOS_TEMPLATE_VFS__
+#define __SOS_TEMPLATE_VFS__
+
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "sqlite/sqliteInt.h"
+#include "sqlite/sqlite3.h"
+
+
+/*
+ * The "sos" VFS: the unix VFS for the files of a template being restored into, with three changes the
+ * pager never sees.
+ *
+ * Write combining: sqlite writes the database one page per call, and the WAL in two calls per frame, a
+ * header and a page. Writes that continue where the previous write of the file ended are copied into a
+ * buffer and written with one call. sqlite may change a page as soon as the write of it returns, so the
+ * pages are copied either way and one pwrite of the buffer does what a pwritev of them would. A
+ * connection stays on one thread, and a thread buffers the writes of one file at a time: the buffer is
+ * written out before the thread writes another file, reads from the buffered range, and before every
+ * lock, sync and wal-index barrier. Other connections only look at the files after one of those, so they
+ * never see a file with writes still buffered.
+ * A buffered write that fails is returned by the call that flushed it; close and the barrier cannot return
+ * one, so theirs is kept on the template and returned by the next write, sync or truncate.
+ *
+ * Preallocation: the first connection to open the database file allocates the size estimated from the
+ * source, and grows the allocation ahead of the size hints sqlite gives before writing past the end of the
+ * file. The space is allocated without changing the file size sqlite sees, and what is left unused beyond
+ * the end of the file is released when that connection closes it.
+ *
+ * Syncs: see fsync_policy_t.
+ */
+
+const char *const template_vfs_name = "sos";
+
+// Which of the syncs sqlite asks for reach the disk.
+enum class fsync_policy_t {
+    // all of them: in WAL mode those of every checkpoint, offline none, the caller syncs at the end
+    checkpoint,
+    // none while the template is written, the database file is synced once when it is closed
+    end,
+    // none at all, for scratch files that are deleted afterwards
+    off,
+};
+
+// How the files of one template are written, and the counters of all connections to it.
+struct template_io_t {
+    // adjacent writes are combined up to this many bytes, 0 writes every call through
+    size_t write_buffer = 0;
+    // bytes of the database file allocated when it is first opened, 0 allocates nothing ahead
+    uint64_t preallocate = 0;
+    fsync_policy_t fsync = fsync_policy_t::checkpoint;
+
+    // writes sqlite made, and the writes they reached the file as
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> file_writes{0};
+    std::atomic<uint64_t> syncs{0};
+    std::atomic<uint64_t> syncs_skipped{0};
+    std::atomic<uint64_t> preallocated{0};
+
+    // taken by the first connection to open the database file, which allocates and releases the space
+    std::atomic<bool> allocator_taken{false};
+
+    // the first write or sync error of a call that cannot return one, close and the wal-index barrier; the
+    // next write, sync or truncate returns it, and complete_restore() fails the restore on it
+    std::atomic<int> error{SQLITE_OK};
+
+    void set_error(int rc) {
+        int none = SQLITE_OK;
+        error.compare_exchange_strong(none, rc);
+    }
+};
+
+struct template_file_t {
+    // what sqlite sees, must come first
+    sqlite3_file base;
+    // the file of the unix VFS, allocated right after this struct
+    sqlite3_file *real = nullptr;
+    std::shared_ptr<template_io_t> io;
+
+    bool main_db = false;
+    bool combining = false;
+    // written since the last sync that reached the disk
+    bool unsynced = false;
+
+    std::vector<char> buffer;
+    sqlite3_int64 buffer_offset = 0;
+
+    // the database file allocated up to here, by the connection that took the allocator
+    bool allocator = false;
+    uint64_t allocated = 0;
+
+    // the file whose writes this thread holds in its buffer
+    static template_file_t *&buffered() {
+        static thread_local template_file_t *file = nullptr;
+        return file;
+    }
+
+    // The writes buffered were reported done to sqlite long ago, a failure is returned by the call flushing them.
+    int flush() {
+        if (buffered() == this) {
+            buffered() = nullptr;
+        }
+
+        if (buffer.empty()) {
+            return SQLITE_OK;
+        }
+
+        int rc = real->pMethods->xWrite(real, buffer.data(), (int) buffer.size(), buffer_offset);
+        io->file_writes += 1;
+        buffer.clear();
+        return rc;
+    }
+
+    static int flush_thread() {
+        return buffered() ? buffered()->flush() : SQLITE_OK;
+    }
+
+    // flush_thread() for calls that change the file, which also report an error no call could return before
+    int flush_for_write() const {
+        int rc = flush_thread();
+        return rc != SQLITE_OK ? rc : io->error.load();
+    }
+
+    // Allocates the database file up to end bytes, keeping its size. Stops trying on file systems that cannot.
+    void allocate(uint64_t end) {
+#ifdef FALLOC_FL_KEEP_SIZE
+        int fd = -1;
+
+        if (!allocator || end <= allocated ||
+            real->pMethods->xFileControl(real, SQLITE_FCNTL_UNIX_HANDLE, &fd) != SQLITE_OK) {
+            return;
+        }
+
+        if (fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t) allocated, (off_t) (end - allocated)) == 0) {
+            io->preallocated += end - allocated;
+            allocated = end;
+        } else {
+            allocator = false;
+        }
+#endif
+    }
+
+    // Frees the allocated space beyond the end of the file: truncating to the same size releases it.
+    void release() {
+        int fd = -1;
+        struct stat st{};
+
+        if (allocator && real->pMethods->xFileControl(real, SQLITE_FCNTL_UNIX_HANDLE, &fd) == SQLITE_OK &&
+            fstat(fd, &st) == 0 && (uint64_t) st.st_size < allocated) {
+            if (ftruncate(fd, st.st_size) != 0) {
+                std::cout << "WARNING: cannot release the space allocated ahead for the template" << std::endl;
+            }
+        }
+    }
+
+    static int close(sqlite3_file *file) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = self->flush();
+
+        if (rc == SQLITE_OK && self->main_db && self->io->fsync == fsync_policy_t::end && self->unsynced) {
+            self->io->syncs += 1;
+            rc = self->real->pMethods->xSync(self->real, SQLITE_SYNC_NORMAL);
+        }
+
+        if (rc != SQLITE_OK) {
+            self->io->set_error(rc);
+        }
+
+        self->release();
+
+        rc = self->real->pMethods->xClose(self->real);
+        self->~template_file_t();
+        return rc;
+    }
+
+    static int read(sqlite3_file *file, void *data, int amount, sqlite3_int64 offset) {
+        template_file_t *self = (template_file_t *) file;
+
+        if (!self->buffer.empty() && offset < self->buffer_offset + (sqlite3_int64) self->buffer.size() &&
+            offset + amount > self->buffer_offset) {
+            int rc = self->flush();
+            if (rc != SQLITE_OK) {
+                return rc;
+            }
+        }
+
+        return self->real->pMethods->xRead(self->real, data, amount, offset);
+    }
+
+    static int write(sqlite3_file *file, const void *data, int amount, sqlite3_int64 offset) {
+        template_file_t *self = (template_file_t *) file;
+        self->io->writes += 1;
+        self->unsynced = true;
+
+        if (int rc = self->io->error.load()) {
+            return rc;
+        }
+
+        if (!self->buffer.empty() &&
+            (offset != self->buffer_offset + (sqlite3_int64) self->buffer.size() ||
+             self->buffer.size() + amount > self->io->write_buffer)) {
+            int rc = self->flush();
+            if (rc != SQLITE_OK) {
+                return rc;
+            }
+        }
+
+        if (!self->combining || (size_t) amount >= self->io->write_buffer) {
+            self->io->file_writes += 1;
+            return self->real->pMethods->xWrite(self->real, data, amount, offset);
+        }
+
+        if (buffered() != self) {
+            int rc = flush_thread();
+            if (rc != SQLITE_OK) {
+                return rc;
+            }
+            buffered() = self;
+        }
+
+        if (self->buffer.empty()) {
+            self->buffer.reserve(self->io->write_buffer);
+            self->buffer_offset = offset;
+        }
+
+        self->buffer.insert(self->buffer.end(), (const char *) data, (const char *) data + amount);
+        return SQLITE_OK;
+    }
+
+    static int truncate(sqlite3_file *file, sqlite3_int64 size) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = self->flush_for_write();
+        return rc != SQLITE_OK ? rc : self->real->pMethods->xTruncate(self->real, size);
+    }
+
+    static int sync(sqlite3_file *file, int flags) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = self->flush_for_write();
+
+        if (rc != SQLITE_OK) {
+            return rc;
+        }
+
+        if (self->io->fsync != fsync_policy_t::checkpoint) {
+            self->io->syncs_skipped += 1;
+            return SQLITE_OK;
+        }
+
+        self->io->syncs += 1;
+        self->unsynced = false;
+        return self->real->pMethods->xSync(self->real, flags);
+    }
+
+    static int file_size(sqlite3_file *file, sqlite3_int64 *size) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = flush_thread();
+        return rc != SQLITE_OK ? rc : self->real->pMethods->xFileSize(self->real, size);
+    }
+
+    static int lock(sqlite3_file *file, int level) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = flush_thread();
+        return rc != SQLITE_OK ? rc : self->real->pMethods->xLock(self->real, level);
+    }
+
+    static int unlock(sqlite3_file *file, int level) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = flush_thread();
+        return rc != SQLITE_OK ? rc : self->real->pMethods->xUnlock(self->real, level);
+    }
+
+    static int check_reserved_lock(sqlite3_file *file, int *result) {
+        template_file_t *self = (template_file_t *) file;
+        return self->real->pMethods->xCheckReservedLock(self->real, result);
+    }
+
+    static int file_control(sqlite3_file *file, int op, void *arg) {
+        template_file_t *self = (template_file_t *) file;
+
+        // a hint comes before sqlite writes past the end of the file: allocate an eighth more than asked for
+        if (op == SQLITE_FCNTL_SIZE_HINT && self->allocator) {
+            uint64_t size = (uint64_t) *(sqlite3_int64 *) arg;
+            if (size > self->allocated) {
+                self->allocate(size + size / 8);
+            }
+            return SQLITE_OK;
+        }
+
+        return self->real->pMethods->xFileControl(self->real, op, arg);
+    }
+
+    static int sector_size(sqlite3_file *file) {
+        template_file_t *self = (template_file_t *) file;
+        return self->real->pMethods->xSectorSize(self->real);
+    }
+
+    static int device_characteristics(sqlite3_file *file) {
+        template_file_t *self = (template_file_t *) file;
+        return self->real->pMethods->xDeviceCharacteristics(self->real);
+    }
+
+    static int shm_map(sqlite3_file *file, int region, int size, int extend, void volatile **memory) {
+        template_file_t *self = (template_file_t *) file;
+        return self->real->pMethods->xShmMap(self->real, region, size, extend, memory);
+    }
+
+    static int shm_lock(sqlite3_file *file, int offset, int n, int flags) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = flush_thread();
+        return rc != SQLITE_OK ? rc : self->real->pMethods->xShmLock(self->real, offset, n, flags);
+    }
+
+    // comes between the two copies of a wal-index header that makes new frames visible
+    static void shm_barrier(sqlite3_file *file) {
+        template_file_t *self = (template_file_t *) file;
+        int rc = flush_thread();
+
+        if (rc != SQLITE_OK) {
+            self->io->set_error(rc);
+        }
+
+        self->real->pMethods->xShmBarrier(self->real);
+    }
+
+    static int shm_unmap(sqlite3_file *file, int delete_flag) {
+        template_file_t *self = (template_file_t *) file;
+        return self->real->pMethods->xShmUnmap(self->real, delete_flag);
+    }
+};
+
+/*
+ * The VFS itself, registered on first use. Everything but opening files is the unix VFS, which it is a
+ * copy of; files of templates not configured are opened through it too and written through.
+ */
+struct template_vfs_t {
+    sqlite3_vfs vfs;
+    sqlite3_vfs *unix_vfs;
+    sqlite3_io_methods methods;
+
+    std::mutex mutex;
+    // by full path of the database file
+    std::map<std::string, std::shared_ptr<template_io_t>> templates;
+    std::shared_ptr<template_io_t> write_through = std::make_shared<template_io_t>();
+
+    static template_vfs_t &instance() {
+        static template_vfs_t *vfs = new template_vfs_t();
+        return *vfs;
+    }
+
+    template_vfs_t() {
+        unix_vfs = sqlite3_vfs_find(nullptr);
+
+        vfs = *unix_vfs;
+        vfs.szOsFile = (int) sizeof(template_file_t) + unix_vfs->szOsFile;
+        vfs.pNext = nullptr;
+        vfs.zName = template_vfs_name;
+        vfs.xOpen = open;
+
+        methods = sqlite3_io_methods{};
+        methods.iVersion = 2;
+        methods.xClose = template_file_t::close;
+        methods.xRead = template_file_t::read;
+        methods.xWrite = template_file_t::write;
+        methods.xTruncate = template_file_t::truncate;
+        methods.xSync = template_file_t::sync;
+        methods.xFileSize = template_file_t::file_size;
+        methods.xLock = template_file_t::lock;
+        methods.xUnlock = template_file_t::unlock;
+        methods.xCheckReservedLock = template_file_t::check_reserved_lock;
+        methods.xFileControl = template_file_t::file_control;
+        methods.xSectorSize = template_file_t::sector_size;
+        methods.xDeviceCharacteristics = template_file_t::device_characteristics;
+        methods.xShmMap = template_file_t::shm_map;
+        methods.xShmLock = template_file_t::shm_lock;
+        methods.xShmBarrier = template_file_t::shm_barrier;
+        methods.xShmUnmap = template_file_t::shm_unmap;
+
+        if (sqlite3_vfs_register(&vfs, 0) != SQLITE_OK) {
+            std::cout << "ERROR: cannot register the " << template_vfs_name << " VFS" << std::endl;
+            std::exit(1);
+        }
+    }
+
+    std::string full_path(const std::string &path) {
+        std::vector<char> full(unix_vfs->mxPathname + 1);
+
+        if (unix_vfs->xFullPathname(unix_vfs, path.data(), (int) full.size(), full.data()) != SQLITE_OK) {
+            std::cout << "ERROR: cannot resolve the path of " << path << std::endl;
+            std::exit(1);
+        }
+
+        return full.data();
+    }
+
+    // Files of the template at path opened through the VFS from now on are written as io says.
+    void configure(const std::string &path, const std::shared_ptr<template_io_t> &io) {
+        std::string full = full_path(path);
+        std::lock_guard<std::mutex> lock(mutex);
+        templates[full] = io;
+    }
+
+    // A WAL belongs to the template of the database file it is named after.
+    std::shared_ptr<template_io_t> find(const char *file_name, int flags) {
+        std::string path = file_name ? file_name : "";
+        std::string wal_suffix = "-wal";
+
+        if ((flags & SQLITE_OPEN_WAL) && path.size() > wal_suffix.size() &&
+            path.compare(path.size() - wal_suffix.size(), wal_suffix.size(), wal_suffix) == 0) {
+            path.resize(path.size() - wal_suffix.size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = templates.find(path);
+        return it == templates.end() ? write_through : it->second;
+    }
+
+    static int open(sqlite3_vfs *, const char *file_name, sqlite3_file *file, int flags, int *out_flags) {
+        template_vfs_t &self = instance();
+        template_file_t *opened = new(file) template_file_t();
+        opened->real = (sqlite3_file *) (opened + 1);
+
+        int rc = self.unix_vfs->xOpen(self.unix_vfs, file_name, opened->real, flags, out_flags);
+        if (rc != SQLITE_OK) {
+            opened->~template_file_t();
+            file->pMethods = nullptr;
+            return rc;
+        }
+
+        opened->io = self.find(file_name, flags);
+        opened->main_db = (flags & SQLITE_OPEN_MAIN_DB) != 0;
+        opened->combining = opened->io->write_buffer > 0 && (flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL));
+
+        if (opened->main_db && opened->io->preallocate > 0 && !opened->io->allocator_taken.exchange(true)) {
+            opened->allocator = true;
+            opened->allocate(opened->io->preallocate);
+        }
+
+        file->pMethods = &self.methods;
+        return SQLITE_OK;
+    }
+};
+
+
+#endif /* __SOS_TEMPLATE_VFS__ */
@@ -0,0 +1,65 @@
+#ifndef __SOS_TRANSACTION_SIZER__
+#define __SOS_TRANSACTION_SIZER__
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+
+/*
+ * Sizes write transactions by the key bytes they insert instead of by source pages, which hold anything
+ * from no cell to hundreds of them, or a few keys with long overflow chains.
+ *
+ * A transaction ends once its keys reach the budget, or once the template pages it holds dirty in the
+ * page cache reach the memory limit, whichever comes first. After every commit the budget moves toward
+ * the size that would have committed in the target time: commit time grows with the pages written, so
+ * the budget is scaled by the ratio of target to measured time, damped to the square root of it and at
+ * most doubled or halved per commit, so a single slow sync does not collapse it.
+ */
+struct transaction_sizer_t {
+    uint64_t min_budget = 64 << 10;
+
+    double target_ms;
+    uint64_t memory_limit;
+    uint64_t budget;
+
+    // the open transaction: key bytes inserted, and whether the memory limit ended it
+    uint64_t bytes = 0;
+    bool memory_bound = false;
+
+    transaction_sizer_t(double target_ms, uint64_t memory_limit, uint64_t initial_budget)
+            : target_ms(target_ms), memory_limit(memory_limit),
+              budget(std::max(min_budget, std::min(initial_budget, memory_limit))) {}
+
+    void add(uint64_t size) {
+        bytes += size;
+    }
+
+    bool full(uint64_t dirty_bytes) {
+        memory_bound = dirty_bytes >= memory_limit;
+        return bytes >= budget || memory_bound;
+    }
+
+    // Takes the measured commit of the transaction just closed; returns the factor the budget changed by.
+    double committed(double commit_ms) {
+        double factor = std::sqrt(target_ms / std::max(commit_ms, 0.01));
+        factor = std::max(0.5, std::min(2.0, factor));
+
+        // a transaction the memory limit ended says nothing about larger ones
+        if (memory_bound && factor > 1) {
+            factor = 1;
+        }
+
+        uint64_t next = (uint64_t) (std::max<double>(bytes, min_budget) * factor);
+        uint64_t previous = budget;
+        budget = std::max(min_budget, std::min(next, memory_limit));
+
+        bytes = 0;
+        memory_bound = false;
+        return budget / (double) previous;
+    }
+};
+
+
+#endif /* __SOS_TRANSACTION_SIZER__ */
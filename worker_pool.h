@@ -0,0 +1,103 @@
+#ifndef __SOS_WORKER_POOL__
+#define __SOS_WORKER_POOL__
+
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/*
+ * A fixed set of threads that run fn(0) .. fn(n - 1) together with the caller of run(), which returns once
+ * all of them are done. Used from one thread at a time.
+ */
+struct worker_pool_t {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+
+    const std::function<void(size_t)> *task = nullptr;
+    size_t count = 0;
+    std::atomic<size_t> next{0};
+    size_t busy = 0;
+    uint64_t generation = 0;
+    bool stop = false;
+
+    // threads includes the caller of run(), so a pool of 1 runs everything on the caller
+    explicit worker_pool_t(int threads) {
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    worker_pool_t(const worker_pool_t &) = delete;
+
+    worker_pool_t &operator=(const worker_pool_t &) = delete;
+
+    ~worker_pool_t() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        started.notify_all();
+
+        for (std::thread &worker: workers) {
+            worker.join();
+        }
+    }
+
+    void run(size_t n, const std::function<void(size_t)> &fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &fn;
+            count = n;
+            next = 0;
+            busy = workers.size();
+            generation += 1;
+        }
+        started.notify_all();
+
+        drain();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return busy == 0; });
+        task = nullptr;
+    }
+
+    void drain() {
+        for (size_t i = next++; i < count; i = next++) {
+            (*task)(i);
+        }
+    }
+
+    void work() {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            started.wait(lock, [this, seen] { return stop || generation != seen; });
+
+            if (stop) {
+                return;
+            }
+
+            seen = generation;
+            lock.unlock();
+            drain();
+            lock.lock();
+
+            if (--busy == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+};
+
+
+#endif /* __SOS_WORKER_POOL__ */